@@ -0,0 +1,100 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+/// Reader throughput of atomic_refc_ptr vs a mutex protected refc_ptr while
+/// one writer keeps replacing the object.
+/// usage: atomic_refc_ptr_bench [max_readers] [milliseconds]
+#include "bench_util.h"
+#include <atomic_refc_ptr.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct config : public refc<config> {
+    config(long v)
+        : value(v)
+    {}
+    long value;
+};
+
+struct mutex_holder {
+    refc_ptr<config> load()
+    {
+        std::lock_guard<std::mutex> l(lock);
+        return p;
+    }
+    void store(refc_ptr<config> n)
+    {
+        std::lock_guard<std::mutex> l(lock);
+        p.swap(n);
+    }
+    std::mutex lock;
+    refc_ptr<config> p{ new config(0) };
+};
+
+struct atomic_holder {
+    refc_ptr<config> load()
+    {
+        return p.load();
+    }
+    void store(refc_ptr<config> n)
+    {
+        p.store(std::move(n));
+    }
+    atomic_refc_ptr<config> p{ refc_ptr<config>(new config(0)) };
+};
+
+/// @return million loads per second, all readers
+template <typename Holder> double readers(int threads, int ms)
+{
+    Holder h;
+    std::atomic<bool> done{ false };
+    std::atomic<long> loads{ 0 };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&] {
+            long n = 0;
+            long sum = 0;
+            while (!done) {
+                sum += h.load()->value;
+                n++;
+            }
+            loads += n + (sum < 0);
+        });
+    }
+    std::thread writer([&] {
+        for (long v = 1; !done; v++) {
+            h.store(refc_ptr<config>(new config(v)));
+            std::this_thread::yield();
+        }
+    });
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    done = true;
+    for (auto &t : workers)
+        t.join();
+    writer.join();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return loads / d.count() / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? std::atoi(argv[1])
+                               : std::thread::hardware_concurrency();
+    int ms = argc > 2 ? std::atoi(argv[2]) : 500;
+    if (max_threads < 1)
+        max_threads = 1;
+
+    std::printf("%8s %14s %14s\n", "readers", "mutex Mops/s", "atomic Mops/s");
+    for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads)) {
+        std::printf("%8d %14.1f %14.1f\n", t, readers<mutex_holder>(t, ms),
+                    readers<atomic_holder>(t, ms));
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+/// Shared helpers for the benchmarks.
+
+/// thread counts for a sweep: 1, 2, 4, ... doubling, with max_threads
+/// itself as the last step when it is not a power of two
+///     for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads))
+inline int next_thread_count(int t, int max_threads)
+{
+    return (t < max_threads && t * 2 > max_threads) ? max_threads : t * 2;
+}
@@ -0,0 +1,72 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+/// Copy/destroy throughput of refc_ptr to one shared object, 1..N threads.
+/// usage: refc_bench [max_threads] [iterations_per_thread]
+#include "bench_util.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ptr.h>
+#include <sharded_refc.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct plain : public refc<plain> {
+    int value = 1;
+};
+
+struct sharded : public refc_sharded<sharded> {
+    int value = 1;
+};
+
+template <typename Ptr> double copy_destroy(const Ptr &p, int threads, long n)
+{
+    std::atomic<int> ready{ 0 };
+    std::atomic<bool> go{ false };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&] {
+            ready++;
+            while (!go)
+                std::this_thread::yield();
+            long sum = 0;
+            for (long j = 0; j < n; j++) {
+                Ptr copy = p;
+                sum += copy->value;
+            }
+            if (sum != n)
+                std::abort();
+        });
+    }
+    while (ready != threads)
+        std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &t : workers)
+        t.join();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    // million copy+destroy pairs per second, all threads
+    return threads * n / d.count() / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? std::atoi(argv[1])
+                               : std::thread::hardware_concurrency();
+    long n = argc > 2 ? std::atol(argv[2]) : 2000000;
+    if (max_threads < 1)
+        max_threads = 1;
+
+    plain::ptr p(new plain);
+    sharded::ptr s(new sharded);
+    std::printf("%8s %14s %14s\n", "threads", "refc Mops/s", "sharded Mops/s");
+    for (int t = 1; t <= max_threads; t = next_thread_count(t, max_threads)) {
+        std::printf("%8d %14.1f %14.1f\n", t, copy_destroy(p, t, n),
+                    copy_destroy(s, t, n));
+    }
+    s->kill();
+    return 0;
+}
@@ -0,0 +1,155 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+
+/*
+ Aliasing intrusive pointer, the counterpart of shared_ptr's aliasing
+ constructor.
+
+ refc_alias_ptr<U, Owner> points at a U inside (or kept alive by) a
+ reference counted Owner, e.g. a member buffer or an array element, and
+ holds a reference to the owner. Copies add_ref the owner; there is no
+ allocation and no count of its own.
+
+     struct image : refc<image> {
+         std::vector<std::uint8_t> pixels;
+     };
+     refc_alias_ptr<std::uint8_t, image> row =
+         make_alias(img, img->pixels.data() + y * stride);
+
+ A refc_ptr<Owner> converts to an alias of the owner itself, and owner()
+ gives the refc_ptr back.
+*/
+
+template <typename U, typename Owner,
+          typename Policy = typename Owner::policy_type>
+class refc_alias_ptr {
+public:
+    using element_type = U;
+    using owner_ptr = refc_ptr<Owner, Policy>;
+
+    constexpr refc_alias_ptr() noexcept = default;
+    constexpr refc_alias_ptr(std::nullptr_t) noexcept
+    {}
+    /// points at p, keeps o alive
+    refc_alias_ptr(owner_ptr o, U *p) noexcept
+        : ptr(p)
+        , own(std::move(o))
+    {}
+    /// points at the owner itself
+    template <typename O, typename = std::enable_if_t<
+                              std::is_convertible<O *, U *>::value &&
+                              std::is_convertible<O *, Owner *>::value>>
+    refc_alias_ptr(const refc_ptr<O, Policy> &o) noexcept
+        : ptr(o.get())
+        , own(o.get())
+    {}
+    template <typename O, typename = std::enable_if_t<
+                              std::is_convertible<O *, U *>::value &&
+                              std::is_convertible<O *, Owner *>::value>>
+    refc_alias_ptr(refc_ptr<O, Policy> &&o) noexcept
+        : ptr(o.get())
+        , own(o.detach(), false)
+    {}
+    refc_alias_ptr(const refc_alias_ptr &o) noexcept = default;
+    refc_alias_ptr(refc_alias_ptr &&o) noexcept
+        : ptr(o.ptr)
+        , own(std::move(o.own))
+    {
+        o.ptr = nullptr;
+    }
+    refc_alias_ptr &operator=(const refc_alias_ptr &rhs) noexcept
+    {
+        refc_alias_ptr(rhs).swap(*this);
+        return *this;
+    }
+    refc_alias_ptr &operator=(refc_alias_ptr &&rhs) noexcept
+    {
+        refc_alias_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    /// points at p, shares the owner of o
+    template <typename V>
+    refc_alias_ptr(const refc_alias_ptr<V, Owner, Policy> &o, U *p) noexcept
+        : ptr(p)
+        , own(o.owner())
+    {}
+    template <typename V,
+              typename = std::enable_if_t<std::is_convertible<V *, U *>::value>>
+    refc_alias_ptr(const refc_alias_ptr<V, Owner, Policy> &o) noexcept
+        : ptr(o.get())
+        , own(o.owner())
+    {}
+    template <typename V,
+              typename = std::enable_if_t<std::is_convertible<V *, U *>::value>>
+    refc_alias_ptr(refc_alias_ptr<V, Owner, Policy> &&o) noexcept
+        : ptr(o.ptr)
+        , own(std::move(o.own))
+    {
+        o.ptr = nullptr;
+    }
+
+    U *get() const noexcept
+    {
+        return ptr;
+    }
+    U *operator->() const noexcept
+    {
+        return ptr;
+    }
+    U &operator*() const noexcept
+    {
+        return *ptr;
+    }
+    explicit operator bool() const noexcept
+    {
+        return ptr;
+    }
+
+    /// the owning pointer
+    const owner_ptr &owner() const noexcept
+    {
+        return own;
+    }
+    /// give up the owner reference to the caller, leaves this empty
+    owner_ptr release_owner() noexcept
+    {
+        ptr = nullptr;
+        return std::move(own);
+    }
+
+    void swap(refc_alias_ptr &rhs) noexcept
+    {
+        std::swap(ptr, rhs.ptr);
+        own.swap(rhs.own);
+    }
+    void reset() noexcept
+    {
+        refc_alias_ptr().swap(*this);
+    }
+
+    friend bool operator==(const refc_alias_ptr &a,
+                           const refc_alias_ptr &b) noexcept
+    {
+        return a.get() == b.get();
+    }
+    friend bool operator!=(const refc_alias_ptr &a,
+                           const refc_alias_ptr &b) noexcept
+    {
+        return a.get() != b.get();
+    }
+
+private:
+    template <typename, typename, typename> friend class refc_alias_ptr;
+
+    U *ptr = nullptr;
+    owner_ptr own;
+};
+
+/// alias of p that keeps o alive
+template <typename U, typename Owner, typename Policy>
+refc_alias_ptr<U, Owner, Policy> make_alias(refc_ptr<Owner, Policy> o,
+                                            U *p) noexcept
+{
+    return refc_alias_ptr<U, Owner, Policy>(std::move(o), p);
+}
@@ -0,0 +1,244 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+
+#ifndef REFC_ARENA_CHECK
+#ifdef NDEBUG
+#define REFC_ARENA_CHECK 0
+#else
+#define REFC_ARENA_CHECK 1
+#endif
+#endif
+
+/*
+ Arena-scoped reference counted objects.
+
+ refc_arena<T> objects are bump-allocated from the object_arena made
+ current by an object_arena_scope, e.g. by make_ptr inside the scope.
+ Their refcount operations are no-ops: nothing is freed until the arena
+ is reset or destroyed, which runs the pending destructors (T's, newest
+ first) and drops all chunks but the first in one go.
+
+ With REFC_ARENA_CHECK (on unless NDEBUG) the arena counts the references
+ to its objects and reset() asserts that none is left, catching refc_ptrs
+ that outlive their arena. Each object then carries a pointer to its arena.
+*/
+
+class object_arena {
+public:
+    static constexpr std::size_t chunk_size = 64 * 1024;
+
+    object_arena() = default;
+    object_arena(const object_arena &) = delete;
+    object_arena &operator=(const object_arena &) = delete;
+    ~object_arena()
+    {
+        reset();
+        if (chunks)
+            ::operator delete(chunks);
+    }
+
+    /// arena of the innermost object_arena_scope on this thread
+    static object_arena *current() noexcept
+    {
+        return tls_current;
+    }
+
+    void *allocate(std::size_t size, std::size_t align)
+    {
+        auto p = (top + align - 1) & ~(align - 1);
+        if (!chunks || p + size > end) {
+            add_chunk(size + align);
+            p = (top + align - 1) & ~(align - 1);
+        }
+        top = p + size;
+        return reinterpret_cast<void *>(p);
+    }
+
+    /// destroy all objects and release the memory, keeping one chunk
+    void reset() noexcept
+    {
+        while (dtors) {
+            auto d = dtors;
+            dtors = d->next;
+            d->destroy(d->obj);
+        }
+#if REFC_ARENA_CHECK
+        assert(refs == 0 && "refc_ptr into the arena outlives reset");
+#endif
+        if (!chunks)
+            return;
+        while (auto next = chunks->next) {
+            ::operator delete(chunks);
+            chunks = next;
+        }
+        top = reinterpret_cast<std::uintptr_t>(chunks + 1);
+        end = reinterpret_cast<std::uintptr_t>(chunks) + chunks->size;
+    }
+
+private:
+    template <typename T> friend class refc_arena;
+    friend class object_arena_scope;
+
+    struct alignas(std::max_align_t) chunk {
+        chunk *next;
+        std::size_t size;
+    };
+
+    struct dtor {
+        void (*destroy)(void *);
+        void *obj;
+        dtor *next;
+    };
+
+    void add_chunk(std::size_t min_size)
+    {
+        auto size = std::max(chunk_size, sizeof(chunk) + min_size);
+        auto c = static_cast<chunk *>(::operator new(size));
+        c->next = chunks;
+        c->size = size;
+        chunks = c;
+        top = reinterpret_cast<std::uintptr_t>(c + 1);
+        end = reinterpret_cast<std::uintptr_t>(c) + size;
+    }
+
+    void add_dtor(void *obj, void (*destroy)(void *))
+    {
+        auto d = static_cast<dtor *>(allocate(sizeof(dtor), alignof(dtor)));
+        *d = { destroy, obj, dtors };
+        dtors = d;
+    }
+
+    // undo the registration of an object whose constructor threw
+    void remove_dtor(void *p, std::size_t size) noexcept
+    {
+        auto first = static_cast<char *>(p);
+        for (auto d = &dtors; *d; d = &(*d)->next) {
+            auto obj = static_cast<char *>((*d)->obj);
+            if (obj >= first && obj < first + size) {
+                *d = (*d)->next;
+                return;
+            }
+        }
+    }
+
+    static inline thread_local object_arena *tls_current = nullptr;
+
+    chunk *chunks = nullptr;
+    std::uintptr_t top = 0;
+    std::uintptr_t end = 0;
+    dtor *dtors = nullptr;
+#if REFC_ARENA_CHECK
+    std::atomic<long> refs{ 0 };
+#endif
+};
+
+/// RAII scope making an arena current for refc_arena allocations on the
+/// calling thread, scopes nest
+class object_arena_scope {
+public:
+    explicit object_arena_scope(object_arena &a) noexcept
+        : prev(object_arena::tls_current)
+    {
+        object_arena::tls_current = &a;
+    }
+    ~object_arena_scope()
+    {
+        object_arena::tls_current = prev;
+    }
+    object_arena_scope(const object_arena_scope &) = delete;
+    object_arena_scope &operator=(const object_arena_scope &) = delete;
+
+private:
+    object_arena *prev;
+};
+
+/// @brief base class for objects living in an object_arena.
+/// Must be created inside an object_arena_scope, creating one anywhere
+/// else terminates (asserts first in debug builds). Only T's destructor is
+/// run on reset, so T should be the most derived type (or subclasses
+/// trivially destructible).
+/// @tparam T derived class for CRTP
+template <typename T> class refc_arena {
+public:
+    // counting is left to the arena, and only in checked builds
+    struct arena_refc_policy {
+        static void add_ref(const refc_arena *p, unsigned long n = 1) noexcept
+        {
+#if REFC_ARENA_CHECK
+            p->arena->refs.fetch_add(n, std::memory_order_relaxed);
+#else
+            (void)p;
+            (void)n;
+#endif
+        }
+        static void release(const refc_arena *p, unsigned long n = 1) noexcept
+        {
+#if REFC_ARENA_CHECK
+            p->arena->refs.fetch_sub(n, std::memory_order_relaxed);
+#else
+            (void)p;
+            (void)n;
+#endif
+        }
+    };
+    using policy_type = arena_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_arena<T>, Y>, bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+    static void *operator new(std::size_t size)
+    {
+        return current_arena().allocate(
+            size, std::max(alignof(T), alignof(std::max_align_t)));
+    }
+    // only reached when a constructor throws, the memory stays in the arena
+    static void operator delete(void *p, std::size_t size) noexcept
+    {
+        if (auto a = object_arena::current())
+            a->remove_dtor(p, size);
+    }
+
+protected:
+    refc_arena(const refc_arena &) = delete;
+    refc_arena &operator=(const refc_arena &) = delete;
+
+    refc_arena()
+    {
+        // also reached without operator new, by placement new or on the
+        // stack
+        auto &a = current_arena();
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            a.add_dtor(this, [](void *x) {
+                static_cast<T *>(static_cast<refc_arena *>(x))->~T();
+            });
+        }
+    }
+
+    ~refc_arena() = default;
+
+private:
+    static object_arena &current_arena() noexcept
+    {
+        auto a = object_arena::current();
+        assert(a && "refc_arena object created outside an object_arena_scope");
+        if (!a)
+            std::terminate();
+        return *a;
+    }
+
+#if REFC_ARENA_CHECK
+    object_arena *arena = object_arena::current();
+#endif
+};
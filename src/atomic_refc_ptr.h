@@ -0,0 +1,197 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <cstdint>
+
+/*
+ Lock-free atomic holder for refc_ptr using split reference counts.
+
+ The stored pointer and a 16-bit count of in-flight readers share one
+ 64-bit word (pointer in the low 48 bits). A reader first bumps the local
+ count, which pins whatever pointer it got, then takes a real reference
+ and gives the local count back. A writer swapping the pointer out turns
+ the local count it swapped out into real references (credits), and the
+ readers that find the pointer gone release a credit instead of
+ decrementing the local count.
+
+ Writers pin the pointer the same way before touching it, and add the
+ credits before their CAS publishes the new pointer, so a reader can never
+ release a credit that is not there yet; surplus credits are dropped after
+ the swap.
+
+ Requires 48-bit user space addresses (x86-64, AArch64) and at most 65535
+ readers inside load() at the same time.
+*/
+
+template <typename T, typename Policy = typename T::policy_type>
+class atomic_refc_ptr {
+    static_assert(sizeof(void *) == 8, "atomic_refc_ptr needs 64-bit pointers");
+
+    using word = std::uint64_t;
+    static constexpr int count_shift = 48;
+    static constexpr word ptr_mask = (word(1) << count_shift) - 1;
+    static constexpr word count_one = word(1) << count_shift;
+
+    static T *ptr_of(word w) noexcept
+    {
+        return reinterpret_cast<T *>(w & ptr_mask);
+    }
+    static word count_of(word w) noexcept
+    {
+        return w >> count_shift;
+    }
+    static word pack(T *p) noexcept
+    {
+        return reinterpret_cast<word>(p);
+    }
+
+public:
+    using element_type = T;
+    using policy = Policy;
+    using value_type = refc_ptr<T, Policy>;
+
+    static constexpr bool is_always_lock_free = true;
+
+    constexpr atomic_refc_ptr() noexcept = default;
+    atomic_refc_ptr(value_type p) noexcept
+        : value(pack(p.detach()))
+    {}
+    atomic_refc_ptr(const atomic_refc_ptr &) = delete;
+    atomic_refc_ptr &operator=(const atomic_refc_ptr &) = delete;
+
+    ~atomic_refc_ptr()
+    {
+        if (auto p = ptr_of(value.load(std::memory_order_relaxed)))
+            policy::release(p);
+    }
+
+    bool is_lock_free() const noexcept
+    {
+        return true;
+    }
+
+    value_type load() const noexcept
+    {
+        auto w = pin();
+        auto p = ptr_of(w);
+        if (p)
+            policy::add_ref(p);
+        unpin(w, p);
+        return value_type(p, false);
+    }
+
+    operator value_type() const noexcept
+    {
+        return load();
+    }
+
+    void store(value_type p) noexcept
+    {
+        exchange(std::move(p));
+    }
+
+    atomic_refc_ptr &operator=(value_type p) noexcept
+    {
+        store(std::move(p));
+        return *this;
+    }
+
+    value_type exchange(value_type p) noexcept
+    {
+        value_type old;
+        swap(p.detach(), nullptr, old);
+        return old;
+    }
+
+    /// replace the stored pointer with desired if it equals expected.
+    /// On failure expected is set to the current value.
+    bool compare_exchange_strong(value_type &expected,
+                                 value_type desired) noexcept
+    {
+        const T *e = expected.get();
+        value_type out;
+        if (!swap(desired.get(), &e, out)) {
+            expected = std::move(out);
+            return false;
+        }
+        desired.detach();
+        return true;
+    }
+
+    bool compare_exchange_weak(value_type &expected, value_type desired) noexcept
+    {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+private:
+    // bump the local count, the returned word's pointer stays alive until
+    // unpin()
+    word pin() const noexcept
+    {
+        return value.fetch_add(count_one, std::memory_order_acquire) +
+               count_one;
+    }
+
+    // give back the local count, or the credit a writer made of it
+    void unpin(word w, T *p) const noexcept
+    {
+        while (ptr_of(w) == p && count_of(w) > 0) {
+            if (value.compare_exchange_weak(w, w - count_one,
+                                            std::memory_order_relaxed))
+                return;
+        }
+        if (p)
+            policy::release(p);
+    }
+
+    // store desired unless expected is given and differs from the current
+    // pointer. @return true and the old stored reference in out, or false
+    // and a new reference to the current value in out
+    bool swap(T *desired, const T *const *expected, value_type &out) noexcept
+    {
+        for (;;) {
+            auto w = pin();
+            auto p = ptr_of(w);
+            if (expected && p != *expected) {
+                if (p)
+                    policy::add_ref(p);
+                unpin(w, p);
+                out = value_type(p, false);
+                return false;
+            }
+            // credits for the other pinned readers must exist before they
+            // can see the pointer gone
+            word credits = 0;
+            do {
+                charge(p, count_of(w) - 1, credits);
+                if (value.compare_exchange_weak(w, pack(desired),
+                                                std::memory_order_acq_rel,
+                                                std::memory_order_relaxed)) {
+                    // our own pin goes away with the swap
+                    drop(p, credits - (count_of(w) - 1));
+                    out = value_type(p, false);
+                    return true;
+                }
+            } while (ptr_of(w) == p && count_of(w) > 0);
+            drop(p, credits);
+            unpin(w, p);
+        }
+    }
+
+    // top up credits on p to cover n pinned readers
+    static void charge(T *p, word n, word &credits) noexcept
+    {
+        if (!p || credits >= n)
+            return;
+        detail::add_refs<policy>(p, n - credits);
+        credits = n;
+    }
+
+    static void drop(T *p, word credits) noexcept
+    {
+        if (p)
+            detail::release_refs<policy>(p, credits);
+    }
+
+    mutable std::atomic<word> value{ 0 };
+};
@@ -0,0 +1,212 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/*
+ Destruction of expensive objects off the releasing thread.
+
+ The last release of a refc_background object does not run the destructor
+ inline but queues the object with a reclaimer, which deletes it on its own
+ thread. The thread is started on first use. drain() waits for everything
+ queued so far, shutdown() drains and stops the thread; after that objects
+ are deleted inline again.
+
+ A destructor running on the reclaimer thread may call either: drain()
+ then deletes what is queued right there instead of waiting for the batch
+ it is part of, and shutdown() also lets the thread exit after that batch,
+ to be joined by a later shutdown() from another thread or the destructor.
+*/
+
+class background_reclaimer {
+public:
+    using deleter = void (*)(const void *);
+    using clock = std::chrono::steady_clock;
+
+    struct stats {
+        std::size_t queue_depth;
+        std::uint64_t reclaimed;
+        clock::duration max_latency;   // enqueue to end of delete
+        clock::duration total_latency; // divide by reclaimed for the mean
+    };
+
+    background_reclaimer() = default;
+    background_reclaimer(const background_reclaimer &) = delete;
+    background_reclaimer &operator=(const background_reclaimer &) = delete;
+    ~background_reclaimer()
+    {
+        shutdown();
+    }
+
+    /// process wide reclaimer used by refc_background
+    static background_reclaimer &instance() noexcept
+    {
+        // leaked on purpose, objects may be released during static
+        // destruction; call shutdown() to reclaim what is left
+        static auto *r = new background_reclaimer;
+        return *r;
+    }
+
+    /// delete p with del on the reclaimer thread
+    void enqueue(const void *p, deleter del) noexcept
+    {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (!stopped) {
+                if (!worker.joinable())
+                    worker = std::thread([this] { run(); });
+                queue.push_back({ p, del, clock::now() });
+                pending++;
+                wake.notify_one();
+                return;
+            }
+        }
+        del(p);
+    }
+
+    /// wait until everything queued so far has been deleted
+    void drain() noexcept
+    {
+        std::unique_lock<std::mutex> l(lock);
+        if (on_worker())
+            reclaim_queued(l);
+        else
+            wait(drained, l, [this] { return pending == 0; });
+    }
+
+    /// drain and stop the reclaimer thread, later objects are deleted inline
+    void shutdown() noexcept
+    {
+        std::thread t;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            auto self = on_worker();
+            if (self)
+                reclaim_queued(l);
+            else
+                wait(drained, l, [this] { return pending == 0; });
+            stopped = true;
+            wake.notify_one();
+            // the thread can't join itself; it returns after its batch and
+            // the next shutdown() from elsewhere (or the destructor) joins it
+            if (self)
+                return;
+            t.swap(worker);
+        }
+        if (t.joinable())
+            t.join();
+    }
+
+    stats get_stats() const noexcept
+    {
+        std::lock_guard<std::mutex> l(lock);
+        return { pending, reclaimed, max_latency, total_latency };
+    }
+
+private:
+    struct item {
+        const void *ptr;
+        deleter del;
+        clock::time_point queued;
+    };
+
+    // timed waits only: condition_variable::wait(unique_lock&) got a new
+    // symbol version in libstdc++ 12 and breaks with older runtimes
+    template <typename Pred>
+    static void wait(std::condition_variable &cv,
+                     std::unique_lock<std::mutex> &l, Pred pred)
+    {
+        while (!cv.wait_for(l, std::chrono::milliseconds(100), pred)) {
+        }
+    }
+
+    // called with lock held
+    bool on_worker() const noexcept
+    {
+        return worker.get_id() == std::this_thread::get_id();
+    }
+
+    void run() noexcept
+    {
+        std::unique_lock<std::mutex> l(lock);
+        for (;;) {
+            wait(wake, l, [this] { return stopped || !queue.empty(); });
+            if (queue.empty())
+                return;
+            reclaim_queued(l);
+        }
+    }
+
+    // delete batches from the queue until it is empty, l is held on entry
+    // and on return
+    void reclaim_queued(std::unique_lock<std::mutex> &l) noexcept
+    {
+        std::vector<item> batch;
+        while (!queue.empty()) {
+            batch.swap(queue);
+            l.unlock();
+            clock::duration total{}, max{};
+            for (auto &i : batch) {
+                i.del(i.ptr);
+                auto latency = clock::now() - i.queued;
+                total += latency;
+                max = std::max(max, latency);
+            }
+            l.lock();
+            reclaimed += batch.size();
+            pending -= batch.size();
+            total_latency += total;
+            max_latency = std::max(max_latency, max);
+            batch.clear();
+            if (pending == 0)
+                drained.notify_all();
+        }
+    }
+
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::vector<item> queue;
+    std::thread worker;
+    std::size_t pending = 0; // queued or being deleted
+    std::uint64_t reclaimed = 0;
+    clock::duration max_latency{};
+    clock::duration total_latency{};
+    bool stopped = false;
+};
+
+/// @brief base class for reference counted objects that are destroyed on
+/// the background reclaimer thread
+/// @tparam T derived class for CRTP
+template <typename T> class refc_background : public refc<T> {
+public:
+    struct background_refc_policy {
+        static auto add_ref(const refc_background *p, unsigned long n = 1) noexcept
+        {
+            return refc<T>::immortal_refc_policy::add_ref(p, n);
+        }
+        static void release(const refc_background *p, unsigned long n = 1) noexcept
+        {
+            if (refc<T>::is_immortal(p->rc.load(std::memory_order_relaxed)))
+                return;
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                background_reclaimer::instance().enqueue(
+                    p, [](const void *x) {
+                        delete static_cast<const refc_background *>(x);
+                    });
+            }
+        }
+    };
+    using policy_type = background_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+protected:
+    using refc<T>::refc;
+};
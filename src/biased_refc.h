@@ -0,0 +1,371 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <mutex>
+#include <vector>
+
+/*
+ Biased reference counting (Choi, Shull, Torrellas, PACT'18).
+
+ Every object is biased towards the thread that created it. The owner
+ updates a plain `biased` counter, every other thread updates the atomic
+ `shared` counter. The object is alive while biased + shared > 0.
+
+ `shared` packs a signed count with two flags:
+   merged - biased part has been folded into `shared`, owner is gone and
+            all threads use the shared counter
+   queued - object sits in its owner's merge queue
+
+ The owner merges implicitly when its own count drops to zero. A non-owner
+ whose decrement leaves the shared count <= 0 cannot tell whether the
+ object is dead, so it queues the object with the owner, which merges it
+ explicitly on its next release or on refc_biased_drain(). When the owner
+ thread has exited, the releasing thread merges on its behalf.
+
+ Memory is kept until the last weak reference is gone, strong references
+ collectively hold one weak reference. It is freed the way delete would
+ free a T (class operator delete, over-alignment), through a function
+ pointer refc_biased<T> stores, since the object is destroyed by then. Queued objects are pinned with an
+ extra weak reference so the owner can always inspect them.
+*/
+
+namespace detail {
+
+class biased_counts;
+
+/// per-thread merge queue, also serves as the owner token of biased objects
+class biased_owner {
+public:
+    biased_owner(const biased_owner &) = delete;
+    biased_owner &operator=(const biased_owner &) = delete;
+
+    /// record of the calling thread, nullptr during thread exit
+    static biased_owner *current() noexcept
+    {
+        if (!tls_record && !tls_exited)
+            holder();
+        return tls_record;
+    }
+    static biased_owner *current_if_any() noexcept
+    {
+        return tls_record;
+    }
+
+    void enqueue(const biased_counts *c) noexcept;
+    void drain() noexcept;
+
+    std::atomic<bool> pending{ false };
+
+private:
+    biased_owner() = default;
+
+    struct freelist {
+        std::mutex lock;
+        std::vector<biased_owner *> records;
+    };
+    static freelist &records() noexcept
+    {
+        // leaked on purpose, objects released by static destructors may
+        // still reach for their owner's record
+        static auto *fl = new freelist;
+        return *fl;
+    }
+
+    // acquires a record on first use and returns it on thread exit
+    struct tls_holder {
+        biased_owner *rec;
+        tls_holder()
+        {
+            auto &fl = records();
+            {
+                std::lock_guard<std::mutex> l(fl.lock);
+                if (fl.records.empty()) {
+                    rec = new biased_owner;
+                } else {
+                    rec = fl.records.back();
+                    fl.records.pop_back();
+                }
+            }
+            std::lock_guard<std::mutex> l(rec->lock);
+            rec->live = true;
+            tls_record = rec;
+        }
+        ~tls_holder()
+        {
+            // from here on this thread releases through the shared counter
+            tls_record = nullptr;
+            tls_exited = true;
+            std::vector<const biased_counts *> left;
+            {
+                std::lock_guard<std::mutex> l(rec->lock);
+                rec->live = false;
+                left.swap(rec->queue);
+            }
+            rec->merge_all(left);
+            auto &fl = records();
+            std::lock_guard<std::mutex> l(fl.lock);
+            fl.records.push_back(rec);
+        }
+    };
+    static void holder() noexcept
+    {
+        static thread_local tls_holder h;
+    }
+
+    void merge_all(const std::vector<const biased_counts *> &items) noexcept;
+
+    static inline thread_local biased_owner *tls_record = nullptr;
+    static inline thread_local bool tls_exited = false;
+
+    std::mutex lock;
+    std::vector<const biased_counts *> queue;
+    bool live = false;
+};
+
+/// counters shared by all biased reference counted objects
+class biased_counts {
+public:
+    static constexpr long long merged_flag = 1;
+    static constexpr long long queued_flag = 2;
+    static constexpr int count_shift = 2;
+    static constexpr long long one = 1ll << count_shift;
+
+    static long long count(long long v) noexcept
+    {
+        // arithmetic shift, the count may go negative
+        return v >> count_shift;
+    }
+
+    bool is_owner() const noexcept
+    {
+        auto o = owner.load(std::memory_order_relaxed);
+        return o && o == biased_owner::current_if_any();
+    }
+
+    unsigned long add_ref(unsigned long n = 1) const noexcept
+    {
+        if (is_owner()) {
+            auto r = biased;
+            biased += n;
+            return r;
+        }
+        return count(shared.fetch_add(static_cast<long long>(n) * one,
+                                      std::memory_order_relaxed));
+    }
+
+    /// @return 0 if the object is already destroyed, nonzero otherwise
+    unsigned long try_ref() const noexcept
+    {
+        if (is_owner())
+            return ++biased;
+        auto v = shared.load(std::memory_order_relaxed);
+        do {
+            if ((v & merged_flag) && count(v) == 0)
+                return 0;
+        } while (!shared.compare_exchange_weak(v, v + one,
+                                               std::memory_order_relaxed));
+        return 1;
+    }
+
+    void release(unsigned long n = 1) const noexcept
+    {
+        if (is_owner()) {
+            if ((biased -= n) == 0) {
+                // implicit merge
+                owner.store(nullptr, std::memory_order_relaxed);
+                auto v = shared.fetch_or(merged_flag, std::memory_order_acq_rel);
+                if (count(v) == 0)
+                    destroy();
+            }
+            auto self = biased_owner::current_if_any();
+            if (self->pending.load(std::memory_order_relaxed))
+                self->drain();
+            return;
+        }
+        bool pinned = false;
+        auto v = shared.load(std::memory_order_relaxed);
+        long long nv;
+        for (;;) {
+            nv = v - static_cast<long long>(n) * one;
+            if (!(nv & (merged_flag | queued_flag)) && count(nv) <= 0) {
+                // the owner may drop the object as soon as the count is
+                // published, keep the memory for the queue
+                if (!pinned) {
+                    weak_rc.fetch_add(1, std::memory_order_relaxed);
+                    pinned = true;
+                }
+                nv |= queued_flag;
+            }
+            if (shared.compare_exchange_weak(v, nv, std::memory_order_acq_rel,
+                                             std::memory_order_relaxed))
+                break;
+        }
+        if (nv & merged_flag) {
+            if (count(nv) == 0)
+                destroy();
+        } else if (nv & queued_flag && !(v & queued_flag)) {
+            if (auto o = owner.load(std::memory_order_relaxed)) {
+                o->enqueue(this);
+                return;
+            }
+        }
+        if (pinned)
+            weak_release();
+    }
+
+    /// fold the biased count into the shared one.
+    /// Must be called by the owner or with the dead owner's record locked.
+    /// @return true if the object has to be destroyed
+    bool merge() const noexcept
+    {
+        if (!owner.load(std::memory_order_relaxed))
+            return false;
+        owner.store(nullptr, std::memory_order_relaxed);
+        auto b = static_cast<long long>(biased);
+        biased = 0;
+        auto v = shared.fetch_add(b * one | merged_flag,
+                                  std::memory_order_acq_rel);
+        return count(v) + b == 0;
+    }
+
+    void destroy() const noexcept
+    {
+        this->~biased_counts();
+        weak_release();
+    }
+
+    void weak_release(unsigned long n = 1) const noexcept
+    {
+        if (weak_rc.fetch_sub(n, std::memory_order_acq_rel) == n)
+            free_storage(this);
+    }
+
+    // refc_ref can't check liveness through refcount()
+    static constexpr bool approximate_refcount = true;
+
+    /// exact on the owner thread or once merged, approximate otherwise;
+    /// other threads may see a negative shared count (releases of
+    /// references the owner counted), reported as 0
+    unsigned long refcount() const noexcept
+    {
+        auto s = count(shared.load(std::memory_order_relaxed));
+        if (is_owner())
+            s += biased;
+        return s > 0 ? static_cast<unsigned long>(s) : 0;
+    }
+
+protected:
+    using deallocator = void (*)(const biased_counts *) noexcept;
+
+    explicit biased_counts(deallocator free_storage) noexcept
+        : free_storage(free_storage)
+        , owner(biased_owner::current())
+        , shared(owner.load(std::memory_order_relaxed) ? 0 : merged_flag)
+    {}
+    biased_counts(const biased_counts &) = delete;
+    biased_counts &operator=(const biased_counts &) = delete;
+    virtual ~biased_counts() = default;
+
+    deallocator free_storage;
+    mutable std::atomic<biased_owner *> owner;
+    mutable unsigned long biased = 0; // owner thread only
+    mutable std::atomic<long long> shared;
+    mutable std::atomic<unsigned long> weak_rc{ 1 };
+};
+
+inline void biased_owner::enqueue(const biased_counts *c) noexcept
+{
+    std::unique_lock<std::mutex> l(lock);
+    if (live) {
+        queue.push_back(c);
+        pending.store(true, std::memory_order_release);
+        return;
+    }
+    // owner is gone, merge on its behalf while nobody can adopt the record
+    bool dead = c->merge();
+    l.unlock();
+    if (dead)
+        c->destroy();
+    c->weak_release();
+}
+
+inline void biased_owner::drain() noexcept
+{
+    std::vector<const biased_counts *> items;
+    pending.store(false, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> l(lock);
+        items.swap(queue);
+    }
+    merge_all(items);
+}
+
+inline void biased_owner::merge_all(
+    const std::vector<const biased_counts *> &items) noexcept
+{
+    for (auto c : items) {
+        if (c->merge())
+            c->destroy();
+        c->weak_release();
+    }
+}
+
+} // namespace detail
+
+/// merge objects other threads have queued for the calling thread.
+/// Happens automatically on the next owner-side release, call this from
+/// threads that create objects but rarely release them.
+inline void refc_biased_drain() noexcept
+{
+    if (auto self = detail::biased_owner::current_if_any())
+        self->drain();
+}
+
+/// @brief base class for objects with biased reference counting
+/// Near non-atomic cost for the creating thread, supports weak pointers.
+/// @tparam T derived class for CRTP
+template <typename T> class refc_biased : public detail::biased_counts {
+public:
+    struct strong_refc_policy {
+        static auto add_ref(const refc_biased *x, unsigned long n = 1) noexcept
+        {
+            return x->biased_counts::add_ref(n);
+        }
+        static auto try_ref(const refc_biased *x) noexcept
+        {
+            return x->biased_counts::try_ref();
+        }
+        static void release(const refc_biased *x, unsigned long n = 1) noexcept
+        {
+            x->biased_counts::release(n);
+        }
+    };
+    struct weak_refc_policy {
+        static auto add_ref(const refc_biased *x, unsigned long n = 1) noexcept
+        {
+            return x->weak_rc.fetch_add(n, std::memory_order_relaxed);
+        }
+        static void release(const refc_biased *x, unsigned long n = 1) noexcept
+        {
+            x->weak_release(n);
+        }
+    };
+    using policy_type = strong_refc_policy;
+    using weak_policy_type = weak_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_biased<T>, Y>, bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+protected:
+    refc_biased() noexcept
+        : biased_counts([](const biased_counts *p) noexcept {
+              detail::deallocate<T>(p);
+          })
+    {}
+};
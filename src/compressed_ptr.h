@@ -0,0 +1,351 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/*
+ 32-bit intrusive pointers into a dedicated heap region.
+
+ A refc_region is one contiguous reservation. Objects of types deriving
+ from region_allocated<Heap> are placed in it, and compressed_refc_ptr
+ stores their position as a 32-bit offset from the region base in units
+ of the region alignment: 8-byte units address 32GB, 16-byte units 64GB.
+
+ The region hands out memory in 64KB pages, each page serving one size
+ class, so deallocation needs only the pointer (as the weak bases require)
+ and there is no per-object header. Objects are limited to one page and
+ to the alignment of the region unit.
+
+ compressed_refc_ptr and compressed_refc_weak_ptr have refc_ptr and
+ refc_weak_ptr semantics and convert to and from refc_ptr.
+
+     struct node_heap {
+         static refc_region<3> &get()
+         {
+             static auto *r = new refc_region<3>(std::size_t(1) << 30);
+             return *r;
+         }
+     };
+     struct node : refc<node>, region_allocated<node_heap> {
+         compressed_refc_ptr<node> next;
+     };
+*/
+
+/// @tparam Shift log2 of the allocation unit, 3 or 4
+template <unsigned Shift = 3> class refc_region {
+    static_assert(Shift == 3 || Shift == 4, "8 or 16 byte units");
+
+public:
+    static constexpr std::size_t alignment = std::size_t(1) << Shift;
+    static constexpr std::size_t page_size = 64 * 1024;
+    // handles 1 to 2^32 - 1, 0 is nullptr; whole pages only
+    static constexpr std::size_t max_capacity =
+        (std::size_t(0xffffffff) << Shift) & ~(page_size - 1);
+
+    explicit refc_region(std::size_t capacity)
+        : pages((std::min(capacity, max_capacity) + page_size - 1) /
+                page_size)
+        , base(static_cast<char *>(
+              ::operator new(pages * page_size, std::align_val_t(page_size))))
+        , page_units(pages, 0)
+        , free_lists(page_size / alignment + 1, nullptr)
+    {}
+    refc_region(const refc_region &) = delete;
+    refc_region &operator=(const refc_region &) = delete;
+    ~refc_region()
+    {
+        ::operator delete(base, std::align_val_t(page_size));
+    }
+
+    void *allocate(std::size_t size)
+    {
+        auto units = std::max<std::size_t>(1, (size + alignment - 1) >> Shift);
+        if (units > page_size / alignment)
+            throw std::bad_alloc();
+        std::lock_guard<std::mutex> l(lock);
+        auto &head = free_lists[units];
+        if (!head)
+            new_page(units);
+        auto b = head;
+        head = b->next;
+        return b;
+    }
+
+    void deallocate(void *p) noexcept
+    {
+        if (!p)
+            return;
+        auto page = (static_cast<char *>(p) - base) / page_size;
+        std::lock_guard<std::mutex> l(lock);
+        auto b = static_cast<block *>(p);
+        b->next = free_lists[page_units[page]];
+        free_lists[page_units[page]] = b;
+    }
+
+    bool contains(const void *p) const noexcept
+    {
+        auto c = static_cast<const char *>(p);
+        return c >= base && c < base + pages * page_size;
+    }
+
+    /// 32-bit handle of p, 0 for nullptr
+    std::uint32_t offset_of(const void *p) const noexcept
+    {
+        if (!p)
+            return 0;
+        assert(contains(p) && "pointer outside the region");
+        return static_cast<std::uint32_t>(
+                   (static_cast<const char *>(p) - base) >> Shift) +
+               1;
+    }
+    void *at(std::uint32_t offset) const noexcept
+    {
+        return offset ? base + (std::size_t(offset - 1) << Shift) : nullptr;
+    }
+
+    /// pages handed out so far, for tests and diagnostics
+    std::size_t pages_used() const noexcept
+    {
+        std::lock_guard<std::mutex> l(lock);
+        return next_page;
+    }
+
+private:
+    struct block {
+        block *next;
+    };
+
+    void new_page(std::size_t units)
+    {
+        if (next_page == pages)
+            throw std::bad_alloc();
+        auto page = next_page++;
+        page_units[page] = static_cast<std::uint16_t>(units);
+        auto first = base + page * page_size;
+        auto size = units << Shift;
+        auto &head = free_lists[units];
+        // pushed last to first so the page is handed out in address order
+        for (auto i = page_size / size; i-- > 0;) {
+            auto b = reinterpret_cast<block *>(first + i * size);
+            b->next = head;
+            head = b;
+        }
+    }
+
+    const std::size_t pages;
+    char *const base;
+    mutable std::mutex lock;
+    std::vector<std::uint16_t> page_units; // size class of each page
+    std::vector<block *> free_lists;       // by size in units
+    std::size_t next_page = 0;
+};
+
+/// derive from this to place a class and its subclasses in Heap::get(),
+/// a refc_region, and make them addressable by compressed_refc_ptr
+template <typename Heap> struct region_allocated {
+    static auto &region() noexcept
+    {
+        return Heap::get();
+    }
+    static void *operator new(std::size_t size)
+    {
+        return region().allocate(size);
+    }
+    static void operator delete(void *p) noexcept
+    {
+        region().deallocate(p);
+    }
+};
+
+namespace detail {
+/// allocation unit of the region T lives in
+template <typename T>
+constexpr std::size_t region_alignment =
+    std::remove_reference_t<decltype(T::region())>::alignment;
+} // namespace detail
+
+/// refc_ptr stored as a 32-bit offset into T's region
+template <typename T, typename Policy = typename T::policy_type>
+class compressed_refc_ptr {
+public:
+    using element_type = T;
+    using policy = Policy;
+
+    constexpr compressed_refc_ptr() noexcept = default;
+    constexpr compressed_refc_ptr(std::nullptr_t) noexcept
+    {}
+    compressed_refc_ptr(T *p, bool ref = true) noexcept
+        : offset(T::region().offset_of(p))
+    {
+        static_assert(alignof(T) <= detail::region_alignment<T>,
+                      "type is over-aligned for its region");
+        if (p && ref)
+            policy::add_ref(p);
+    }
+    template <typename U,
+              typename = std::enable_if_t<std::is_convertible<U *, T *>::value>>
+    compressed_refc_ptr(const refc_ptr<U, Policy> &p) noexcept
+        : compressed_refc_ptr(p.get())
+    {}
+    compressed_refc_ptr(refc_ptr<T, Policy> &&p) noexcept
+        : compressed_refc_ptr(p.detach(), false)
+    {}
+    compressed_refc_ptr(const compressed_refc_ptr &o) noexcept
+        : offset(o.offset)
+    {
+        if (offset)
+            policy::add_ref(get());
+    }
+    compressed_refc_ptr(compressed_refc_ptr &&o) noexcept
+        : offset(o.offset)
+    {
+        o.offset = 0;
+    }
+    compressed_refc_ptr &operator=(const compressed_refc_ptr &rhs) noexcept
+    {
+        compressed_refc_ptr(rhs).swap(*this);
+        return *this;
+    }
+    compressed_refc_ptr &operator=(compressed_refc_ptr &&rhs) noexcept
+    {
+        compressed_refc_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    ~compressed_refc_ptr()
+    {
+        if (offset)
+            policy::release(get());
+    }
+
+    void swap(compressed_refc_ptr &rhs) noexcept
+    {
+        std::swap(offset, rhs.offset);
+    }
+    void reset() noexcept
+    {
+        compressed_refc_ptr().swap(*this);
+    }
+
+    T *get() const noexcept
+    {
+        return static_cast<T *>(T::region().at(offset));
+    }
+    T *operator->() const noexcept
+    {
+        return get();
+    }
+    T &operator*() const noexcept
+    {
+        return *get();
+    }
+    explicit operator bool() const noexcept
+    {
+        return offset != 0;
+    }
+
+    /// the same object as an ordinary refc_ptr
+    refc_ptr<T, Policy> to_ptr() const noexcept
+    {
+        return refc_ptr<T, Policy>(get());
+    }
+    operator refc_ptr<T, Policy>() const noexcept
+    {
+        return to_ptr();
+    }
+
+    friend bool operator==(const compressed_refc_ptr &a,
+                           const compressed_refc_ptr &b) noexcept
+    {
+        return a.offset == b.offset;
+    }
+    friend bool operator!=(const compressed_refc_ptr &a,
+                           const compressed_refc_ptr &b) noexcept
+    {
+        return a.offset != b.offset;
+    }
+
+private:
+    std::uint32_t offset = 0;
+};
+
+/// refc_weak_ptr stored as a 32-bit offset into T's region. The region
+/// keeps the memory of weak based objects until the last weak release,
+/// so the offset stays valid.
+template <typename T, typename Policy = typename T::policy_type,
+          typename WeakPolicy = typename T::weak_policy_type>
+class compressed_refc_weak_ptr {
+public:
+    using policy = Policy;
+    using weak_policy = WeakPolicy;
+
+    constexpr compressed_refc_weak_ptr() noexcept = default;
+    compressed_refc_weak_ptr(const refc_ptr<T, Policy> &p) noexcept
+        : compressed_refc_weak_ptr(p.get())
+    {}
+    compressed_refc_weak_ptr(const compressed_refc_ptr<T, Policy> &p) noexcept
+        : compressed_refc_weak_ptr(p.get())
+    {}
+    compressed_refc_weak_ptr(const compressed_refc_weak_ptr &o) noexcept
+        : offset(o.offset)
+    {
+        if (offset)
+            weak_policy::add_ref(get());
+    }
+    compressed_refc_weak_ptr(compressed_refc_weak_ptr &&o) noexcept
+        : offset(o.offset)
+    {
+        o.offset = 0;
+    }
+    compressed_refc_weak_ptr &
+    operator=(const compressed_refc_weak_ptr &rhs) noexcept
+    {
+        compressed_refc_weak_ptr(rhs).swap(*this);
+        return *this;
+    }
+    compressed_refc_weak_ptr &operator=(compressed_refc_weak_ptr &&rhs) noexcept
+    {
+        compressed_refc_weak_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    ~compressed_refc_weak_ptr()
+    {
+        if (offset)
+            weak_policy::release(get());
+    }
+
+    void swap(compressed_refc_weak_ptr &rhs) noexcept
+    {
+        std::swap(offset, rhs.offset);
+    }
+
+    /// lock weak pointer to shared pointer
+    /// @return shared pointer or empty shared pointer if object is gone
+    refc_ptr<T, Policy> lock() const noexcept
+    {
+        if (!offset || policy::try_ref(get()) == 0)
+            return {};
+        return refc_ptr<T, Policy>(get(), false);
+    }
+
+private:
+    explicit compressed_refc_weak_ptr(T *p) noexcept
+        : offset(T::region().offset_of(p))
+    {
+        static_assert(alignof(T) <= detail::region_alignment<T>,
+                      "type is over-aligned for its region");
+        if (p)
+            weak_policy::add_ref(p);
+    }
+
+    T *get() const noexcept
+    {
+        return static_cast<T *>(T::region().at(offset));
+    }
+
+    std::uint32_t offset = 0;
+};
@@ -0,0 +1,222 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <cstdint>
+
+/*
+ Weak references through an out-of-line control block.
+
+ refc_weak_base keeps both counts in the object, so the object's memory
+ stays allocated until the last weak reference is gone. Here the counts
+ live in a separate 8-byte control block (strong in the low 32 bits, weak
+ in the high 32, the strong group holding one weak reference). The object
+ is deleted, memory and all, on the last strong release; weak pointers
+ only keep the control block.
+
+ The price is an allocation per object and an indirection on every count
+ update. refc_ctl_weak_ptr::lock() is a CAS loop on the control block.
+*/
+
+namespace detail {
+
+struct ctl_counts {
+    static constexpr std::uint64_t strong_one = 1;
+    static constexpr std::uint64_t weak_one = std::uint64_t(1) << 32;
+    static constexpr std::uint64_t strong_mask = weak_one - 1;
+
+    std::atomic<std::uint64_t> counts{ weak_one };
+
+    static std::uint32_t strong(std::uint64_t v) noexcept
+    {
+        return static_cast<std::uint32_t>(v & strong_mask);
+    }
+
+    void add_weak() noexcept
+    {
+        counts.fetch_add(weak_one, std::memory_order_relaxed);
+    }
+    void release_weak() noexcept
+    {
+        if (counts.fetch_sub(weak_one, std::memory_order_acq_rel) >> 32 == 1)
+            delete this;
+    }
+    /// @return previous strong count, 0 if the object is gone
+    std::uint32_t try_ref() noexcept
+    {
+        auto v = counts.load(std::memory_order_relaxed);
+        while (strong(v) > 0) {
+            if (counts.compare_exchange_weak(v, v + strong_one,
+                                             std::memory_order_relaxed))
+                return strong(v);
+        }
+        return 0;
+    }
+};
+
+} // namespace detail
+
+template <typename T> class refc_ctl_weak_ptr;
+
+/// @brief base class for reference counted objects with weak references
+/// that don't keep the object's memory alive
+/// @tparam T derived class for CRTP
+template <typename T> class refc_ctl_weak_base {
+public:
+    struct strong_refc_policy {
+        static auto add_ref(const refc_ctl_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            return detail::ctl_counts::strong(x->ctl->counts.fetch_add(
+                n * detail::ctl_counts::strong_one, std::memory_order_relaxed));
+        }
+        static auto try_ref(const refc_ctl_weak_base *x) noexcept
+        {
+            return x->ctl->try_ref();
+        }
+        static void release(const refc_ctl_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            auto c = x->ctl;
+            auto v = c->counts.fetch_sub(n * detail::ctl_counts::strong_one,
+                                         std::memory_order_release);
+            if (detail::ctl_counts::strong(v) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                // the control block outlives the object if weak pointers
+                // are left
+                x->ctl = nullptr;
+                delete x;
+                c->release_weak();
+            }
+        }
+    };
+    using policy_type = strong_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+    using weak_ptr = refc_ctl_weak_ptr<T>;
+
+    unsigned long refcount() const noexcept
+    {
+        return detail::ctl_counts::strong(
+            ctl->counts.load(std::memory_order_relaxed));
+    }
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_ctl_weak_base<T>, Y>,
+                               bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+protected:
+    refc_ctl_weak_base(const refc_ctl_weak_base &) = delete;
+    refc_ctl_weak_base &operator=(const refc_ctl_weak_base &) = delete;
+
+    refc_ctl_weak_base()
+        : ctl(new detail::ctl_counts)
+    {}
+
+    virtual ~refc_ctl_weak_base()
+    {
+        // still set if the object was never released, e.g. a derived
+        // constructor threw
+        delete ctl;
+    }
+
+private:
+    template <typename U> friend class refc_ctl_weak_ptr;
+
+    mutable detail::ctl_counts *ctl;
+};
+
+/// weak pointer to a refc_ctl_weak_base object, holds the control block
+/// and the object pointer that is valid while lock() succeeds
+template <typename T> class refc_ctl_weak_ptr {
+public:
+    using element_type = T;
+
+    constexpr refc_ctl_weak_ptr() noexcept = default;
+    template <typename U,
+              typename = std::enable_if_t<std::is_convertible<U *, T *>::value>>
+    refc_ctl_weak_ptr(const refc_ptr<U> &o) noexcept
+    {
+        if (auto p = o.get()) {
+            ptr = p;
+            ctl = p->ctl;
+            ctl->add_weak();
+        }
+    }
+    refc_ctl_weak_ptr(const refc_ctl_weak_ptr &o) noexcept
+        : ptr(o.ptr)
+        , ctl(o.ctl)
+    {
+        if (ctl)
+            ctl->add_weak();
+    }
+    refc_ctl_weak_ptr(refc_ctl_weak_ptr &&o) noexcept
+        : ptr(o.ptr)
+        , ctl(o.ctl)
+    {
+        o.ptr = nullptr;
+        o.ctl = nullptr;
+    }
+    template <typename U,
+              typename = std::enable_if_t<std::is_convertible<U *, T *>::value>>
+    refc_ctl_weak_ptr(const refc_ctl_weak_ptr<U> &o) noexcept
+        : ptr(o.ptr)
+        , ctl(o.ctl)
+    {
+        if (ctl)
+            ctl->add_weak();
+    }
+
+    refc_ctl_weak_ptr &operator=(const refc_ctl_weak_ptr &rhs) noexcept
+    {
+        refc_ctl_weak_ptr(rhs).swap(*this);
+        return *this;
+    }
+    refc_ctl_weak_ptr &operator=(refc_ctl_weak_ptr &&rhs) noexcept
+    {
+        refc_ctl_weak_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    refc_ctl_weak_ptr &operator=(const refc_ptr<T> &rhs) noexcept
+    {
+        refc_ctl_weak_ptr(rhs).swap(*this);
+        return *this;
+    }
+    ~refc_ctl_weak_ptr()
+    {
+        if (ctl)
+            ctl->release_weak();
+    }
+    void swap(refc_ctl_weak_ptr &rhs) noexcept
+    {
+        std::swap(ptr, rhs.ptr);
+        std::swap(ctl, rhs.ctl);
+    }
+    void reset() noexcept
+    {
+        refc_ctl_weak_ptr().swap(*this);
+    }
+
+    bool expired() const noexcept
+    {
+        return !ctl || detail::ctl_counts::strong(ctl->counts.load(
+                           std::memory_order_relaxed)) == 0;
+    }
+
+    /// lock weak pointer to shared pointer
+    /// @return shared pointer or empty shared pointer if object is gone
+    refc_ptr<T> lock() const noexcept
+    {
+        if (!ctl || ctl->try_ref() == 0)
+            return {};
+        return refc_ptr<T>(ptr, false);
+    }
+
+private:
+    template <typename U> friend class refc_ctl_weak_ptr;
+
+    T *ptr = nullptr;
+    detail::ctl_counts *ctl = nullptr;
+};
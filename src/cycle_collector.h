@@ -0,0 +1,441 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <cstdint>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ Cycle collection for reference counted objects, in the style of CPython's
+ trial deletion.
+
+ refc_collectable<T> objects report their refc_ptr members through a
+ traverse(cycle_visitor &) override. A release that leaves the count
+ nonzero may have orphaned a cycle, so it buffers the object as a
+ candidate root (once, until the collector looks at it).
+
+ A collection step takes a batch of roots, gathers the objects reachable
+ from them, subtracts the references those objects hold to each other and
+ keeps whatever still has references from outside, plus everything
+ reachable from that. The rest is garbage: each garbage object is pinned,
+ its reported pointers are reset, then it is unpinned and deleted through
+ the usual release path, so destructors see their members already null.
+
+ collect_step(budget) deletes or looks at no more than `budget` objects
+ itself: buffered roots that died meanwhile count one each, and so does
+ every object gathered for trial deletion (the garbage among them).
+ Roots that no longer fit are left for the next step, and a root too big
+ for a whole step on its own is deferred to the next full collect(),
+ unless its last reference goes away first: steps delete dead deferred
+ roots like any other dead root.
+ What the destructors of deleted objects release in turn is not counted:
+ a step that frees the last owner of a large acyclic structure pays for
+ it. Call collect_step() periodically (from an event loop or timer) and
+ collect() when an unbounded pause is acceptable.
+
+ Buffering roots is thread-safe. A collection reads counts and pointers
+ without synchronization, so it must not run while other threads change
+ collectable objects: run it on the thread that owns them, or with the
+ mutators stopped. An object whose last reference goes away while it is
+ buffered is deleted by the next collection.
+
+ Unreported pointers are safe but make cycles through them uncollectable.
+*/
+
+class cycle_collector;
+namespace detail {
+class collectable;
+}
+
+/// passed to traverse(), call it on every refc_ptr to a collectable
+/// object the traversed object owns
+class cycle_visitor {
+public:
+    template <typename U, typename P> void operator()(refc_ptr<U, P> &p)
+    {
+        static_assert(std::is_base_of_v<detail::collectable, U>,
+                      "only refc_collectable objects can be traversed");
+        if (!p)
+            return;
+        if (clearing)
+            p.reset();
+        else
+            fn(ctx, const_cast<std::remove_const_t<U> *>(p.get()));
+    }
+
+private:
+    friend class cycle_collector;
+
+    cycle_visitor(void (*fn)(void *, detail::collectable *), void *ctx,
+                  bool clearing = false) noexcept
+        : fn(fn)
+        , ctx(ctx)
+        , clearing(clearing)
+    {}
+
+    void (*fn)(void *, detail::collectable *);
+    void *ctx;
+    bool clearing;
+};
+
+namespace detail {
+
+/// type independent part of refc_collectable, used by the collector
+class collectable {
+public:
+    /// report owned pointers to collectable objects, see cycle_visitor
+    virtual void traverse(cycle_visitor &)
+    {}
+
+protected:
+    friend class ::cycle_collector;
+
+    static constexpr unsigned char buffered = 1;   // in the root buffer
+    static constexpr unsigned char dead = 2;       // released while buffered
+    static constexpr unsigned char collecting = 4; // being collected
+
+    collectable() = default;
+    collectable(const collectable &) = delete;
+    collectable &operator=(const collectable &) = delete;
+    virtual ~collectable() = default;
+
+    virtual unsigned long gc_refcount() const noexcept = 0;
+    virtual void gc_add_ref() noexcept = 0;
+    virtual void gc_release() noexcept = 0;
+
+    mutable std::atomic<unsigned char> gc_flags{ 0 };
+};
+
+} // namespace detail
+
+class cycle_collector {
+public:
+    struct stats {
+        std::size_t roots;       // buffered, waiting for a step
+        std::size_t deferred;    // too big for a step, waiting for collect()
+        std::uint64_t collected; // objects freed as cyclic garbage
+        std::uint64_t steps;
+        std::uint64_t aborted;   // steps that ran out of budget
+    };
+
+    static constexpr std::size_t default_budget = 10000;
+
+    cycle_collector() = default;
+    cycle_collector(const cycle_collector &) = delete;
+    cycle_collector &operator=(const cycle_collector &) = delete;
+
+    /// process wide collector used by refc_collectable
+    static cycle_collector &instance() noexcept
+    {
+        // leaked on purpose, objects may be released during static
+        // destruction
+        static auto *c = new cycle_collector;
+        return *c;
+    }
+
+    /// add a candidate root, called by the release policy
+    void buffer(detail::collectable *p) noexcept
+    {
+        try {
+            std::lock_guard<std::mutex> l(lock);
+            if (p->gc_flags.load(std::memory_order_relaxed) &
+                detail::collectable::buffered)
+                return;
+            roots.insert(p);
+            p->gc_flags.fetch_or(detail::collectable::buffered,
+                                 std::memory_order_relaxed);
+        } catch (...) {
+            // a root lost to low memory only means a cycle may leak
+        }
+    }
+
+    /// one bounded collection step over at most `budget` objects
+    /// @return number of objects freed as cyclic garbage
+    std::size_t collect_step(std::size_t budget = default_budget)
+    {
+        std::vector<detail::collectable *> batch;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            steps++;
+            // deferred roots that died since are plain deletions, which a
+            // step can afford
+            for (auto i = deferred.begin();
+                 i != deferred.end() && batch.size() < budget;) {
+                if ((*i)->gc_flags.load(std::memory_order_relaxed) &
+                    collectable::dead) {
+                    batch.push_back(*i);
+                    i = deferred.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            while (batch.size() < budget && !roots.empty()) {
+                batch.push_back(*roots.begin());
+                roots.erase(roots.begin());
+            }
+        }
+        return scan(std::move(batch), budget);
+    }
+
+    /// collect everything, including deferred roots; the pause is not
+    /// bounded
+    /// @return number of objects freed as cyclic garbage
+    std::size_t collect()
+    {
+        std::size_t freed = 0;
+        for (;;) {
+            std::vector<detail::collectable *> batch;
+            {
+                std::lock_guard<std::mutex> l(lock);
+                steps++;
+                batch.assign(roots.begin(), roots.end());
+                batch.insert(batch.end(), deferred.begin(), deferred.end());
+                roots.clear();
+                deferred.clear();
+            }
+            if (batch.empty())
+                return freed;
+            // destructors of the garbage may buffer new roots
+            freed += scan(std::move(batch), static_cast<std::size_t>(-1));
+        }
+    }
+
+    stats get_stats() const
+    {
+        std::lock_guard<std::mutex> l(lock);
+        return { roots.size(), deferred.size(), collected, steps, aborted };
+    }
+
+private:
+    using collectable = detail::collectable;
+
+    struct node_state {
+        long refs; // count minus references from the scanned objects
+        bool live;
+    };
+    using graph = std::unordered_map<collectable *, node_state>;
+
+    // call fn(&ctx, y) for every y reported by x
+    template <typename Ctx>
+    static void traverse(collectable *x, Ctx &ctx,
+                         void (*fn)(void *, collectable *))
+    {
+        cycle_visitor v(fn, &ctx);
+        x->traverse(v);
+    }
+
+    std::size_t scan(std::vector<collectable *> batch, std::size_t budget)
+    {
+        // delete roots whose last reference went away while buffered; the
+        // others stay flagged meanwhile, so these destructors can only
+        // make them dead too, never delete them
+        std::size_t spent = 0;
+        for (bool again = true; again;) {
+            again = false;
+            for (auto i = batch.begin(); i != batch.end();) {
+                auto r = *i;
+                if (!(r->gc_flags.load(std::memory_order_relaxed) &
+                      collectable::dead)) {
+                    ++i;
+                    continue;
+                }
+                if (spent == budget) {
+                    // still flagged, the next step deletes the rest
+                    put_back(batch, 0, false);
+                    return 0;
+                }
+                i = batch.erase(i);
+                spent++;
+                r->gc_flags.store(0, std::memory_order_relaxed);
+                r->gc_add_ref();
+                r->gc_release();
+                again = true;
+            }
+        }
+        budget -= spent;
+
+        // gather the objects reachable from each root, as many roots as
+        // the budget allows; a closure that doesn't fit is rolled back
+        graph g;
+        std::vector<collectable *> order;
+        struct gather_ctx {
+            graph *g;
+            std::vector<collectable *> *order;
+        } gc{ &g, &order };
+        std::size_t done = 0;
+        for (; done < batch.size(); done++) {
+            auto mark = order.size();
+            auto r = batch[done];
+            if (!g.emplace(r, node_state{ long(r->gc_refcount()), false })
+                     .second)
+                continue;
+            order.push_back(r);
+            for (auto i = mark; i < order.size() && order.size() <= budget;
+                 i++) {
+                traverse(order[i], gc, [](void *c, collectable *x) {
+                    auto &ctx = *static_cast<gather_ctx *>(c);
+                    node_state s{ long(x->gc_refcount()), false };
+                    if (ctx.g->emplace(x, s).second)
+                        ctx.order->push_back(x);
+                });
+            }
+            if (order.size() > budget) {
+                for (auto i = mark; i < order.size(); i++)
+                    g.erase(order[i]);
+                order.resize(mark);
+                break;
+            }
+        }
+        if (done < batch.size())
+            put_back(batch, done, spent == 0);
+        for (std::size_t i = 0; i < done; i++) {
+            batch[i]->gc_flags.fetch_and(
+                static_cast<unsigned char>(~collectable::buffered),
+                std::memory_order_relaxed);
+        }
+
+        // subtract internal references
+        for (auto x : order) {
+            traverse(x, g, [](void *c, collectable *y) {
+                static_cast<graph *>(c)->find(y)->second.refs--;
+            });
+        }
+
+        // referenced from outside, and everything reachable from there
+        std::vector<collectable *> live;
+        for (auto &i : g) {
+            if (i.second.refs > 0) {
+                i.second.live = true;
+                live.push_back(i.first);
+            }
+        }
+        struct mark_ctx {
+            graph *g;
+            std::vector<collectable *> *live;
+        } mc{ &g, &live };
+        while (!live.empty()) {
+            auto x = live.back();
+            live.pop_back();
+            traverse(x, mc, [](void *c, collectable *y) {
+                auto &ctx = *static_cast<mark_ctx *>(c);
+                auto &s = ctx.g->find(y)->second;
+                if (!s.live) {
+                    s.live = true;
+                    ctx.live->push_back(y);
+                }
+            });
+        }
+
+        std::vector<collectable *> garbage;
+        for (auto x : order) {
+            if (!g[x].live)
+                garbage.push_back(x);
+        }
+        reclaim(garbage);
+        return garbage.size();
+    }
+
+    // return the roots a step had no budget for; a first root that is too
+    // big for a whole step on its own is put aside for collect()
+    void put_back(const std::vector<collectable *> &batch, std::size_t done,
+                  bool defer_first)
+    {
+        std::lock_guard<std::mutex> l(lock);
+        if (done == 0 && defer_first) {
+            aborted++;
+            deferred.insert(batch[done++]);
+        }
+        roots.insert(batch.begin() + done, batch.end());
+    }
+
+    void reclaim(const std::vector<collectable *> &garbage)
+    {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            for (auto x : garbage) {
+                roots.erase(x);
+                deferred.erase(x);
+                x->gc_flags.store(collectable::collecting,
+                                  std::memory_order_relaxed);
+            }
+            collected += garbage.size();
+        }
+        // the pin keeps every object alive while the cycles are cut
+        for (auto x : garbage)
+            x->gc_add_ref();
+        for (auto x : garbage) {
+            cycle_visitor clear(nullptr, nullptr, true);
+            x->traverse(clear);
+        }
+        for (auto x : garbage)
+            x->gc_release();
+    }
+
+    mutable std::mutex lock;
+    std::unordered_set<collectable *> roots;
+    std::unordered_set<collectable *> deferred;
+    std::uint64_t collected = 0;
+    std::uint64_t steps = 0;
+    std::uint64_t aborted = 0;
+};
+
+/// @brief base class for reference counted objects whose cycles are
+/// reclaimed by cycle_collector. Override traverse() to report the
+/// refc_ptr members.
+/// @tparam T derived class for CRTP
+template <typename T>
+class refc_collectable : public refc<T>, public detail::collectable {
+public:
+    struct collectable_refc_policy {
+        static auto add_ref(const refc_collectable *p,
+                            unsigned long n = 1) noexcept
+        {
+            return refc<T>::immortal_refc_policy::add_ref(p, n);
+        }
+        static void release(const refc_collectable *p,
+                            unsigned long n = 1) noexcept
+        {
+            auto r = p->rc.load(std::memory_order_relaxed);
+            if (refc<T>::is_immortal(r))
+                return;
+            // buffer while we still hold a reference; if we hold them all
+            // the object dies here and is no candidate
+            if (r != n && !(p->gc_flags.load(std::memory_order_relaxed) &
+                            (buffered | collecting)))
+                cycle_collector::instance().buffer(
+                    const_cast<refc_collectable *>(p));
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (p->gc_flags.load(std::memory_order_relaxed) & buffered) {
+                    // the collector owns the root buffer entry
+                    p->gc_flags.fetch_or(dead, std::memory_order_relaxed);
+                    return;
+                }
+                delete p;
+            }
+        }
+    };
+    using policy_type = collectable_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+protected:
+    refc_collectable() = default;
+
+private:
+    unsigned long gc_refcount() const noexcept final
+    {
+        return this->refcount();
+    }
+    void gc_add_ref() noexcept final
+    {
+        policy_type::add_ref(this);
+    }
+    void gc_release() noexcept final
+    {
+        policy_type::release(this);
+    }
+};
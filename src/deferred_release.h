@@ -0,0 +1,185 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+/*
+ Deferred, coalesced reference count decrements.
+
+ Releasing a refc_deferred object only bumps a per-object counter in a
+ small thread-local table. The table is flushed at batch boundaries
+ (flush_deferred_releases(), deferred_release_batch), when it fills up and
+ on thread exit; a flush turns N buffered releases of one object into a
+ single fetch_sub(N) and deletes the object if that was the last reference.
+ Releases made by the destructors a flush runs are applied by the same
+ flush.
+
+ Buffered releases keep objects alive until the owning thread flushes,
+ so the count can never reach zero early and destruction happens exactly
+ once, on the flushing thread.
+*/
+
+namespace detail {
+
+class deferred_releases {
+public:
+    using flush_fn = void (*)(const void *, unsigned long);
+    static constexpr unsigned capacity = 64;
+
+    /// table of the calling thread, nullptr once it has been torn down
+    static deferred_releases *local() noexcept
+    {
+        if (!tls_table && !tls_exited)
+            holder();
+        return tls_table;
+    }
+
+    void add(const void *p, flush_fn fn, unsigned long n = 1) noexcept
+    {
+        auto i = slot_of(p);
+        for (;; i = (i + 1) % capacity) {
+            auto &e = entries[i];
+            if (e.ptr == p) {
+                e.count += n;
+                return;
+            }
+            if (!e.ptr) {
+                e = { p, fn, n };
+                // keep probe chains short
+                if (++used == capacity * 3 / 4)
+                    flush();
+                return;
+            }
+        }
+    }
+
+    /// apply everything buffered, including releases made by the
+    /// destructors this runs
+    void flush() noexcept
+    {
+        // deleting objects may release more, each pass starts over with a
+        // clean table
+        while (used) {
+            entry pending[capacity];
+            std::copy(std::begin(entries), std::end(entries), pending);
+            std::fill(std::begin(entries), std::end(entries), entry{});
+            used = 0;
+            for (auto &e : pending) {
+                if (e.ptr)
+                    e.fn(e.ptr, e.count);
+            }
+        }
+    }
+
+    /// buffered releases for p, for tests and diagnostics
+    unsigned long pending(const void *p) const noexcept
+    {
+        for (auto i = slot_of(p); entries[i].ptr; i = (i + 1) % capacity) {
+            if (entries[i].ptr == p)
+                return entries[i].count;
+        }
+        return 0;
+    }
+
+private:
+    struct entry {
+        const void *ptr = nullptr;
+        flush_fn fn = nullptr;
+        unsigned long count = 0;
+    };
+
+    static unsigned slot_of(const void *p) noexcept
+    {
+        auto h = reinterpret_cast<std::uintptr_t>(p) >> 4;
+        return static_cast<unsigned>((h ^ (h >> 7)) % capacity);
+    }
+
+    struct tls_holder;
+    static void holder() noexcept;
+
+    static inline thread_local deferred_releases *tls_table = nullptr;
+    static inline thread_local bool tls_exited = false;
+
+    entry entries[capacity];
+    unsigned used = 0;
+};
+
+struct deferred_releases::tls_holder {
+    deferred_releases table;
+    tls_holder() noexcept
+    {
+        tls_table = &table;
+    }
+    ~tls_holder()
+    {
+        table.flush();
+        // releases from later thread-local destructors go straight to the
+        // counter
+        tls_table = nullptr;
+        tls_exited = true;
+    }
+};
+
+inline void deferred_releases::holder() noexcept
+{
+    static thread_local tls_holder h;
+}
+
+} // namespace detail
+
+/// apply the calling thread's buffered releases
+inline void flush_deferred_releases() noexcept
+{
+    if (auto t = detail::deferred_releases::local())
+        t->flush();
+}
+
+/// RAII batch boundary, flushes the calling thread's buffered releases
+/// when it goes out of scope
+class deferred_release_batch {
+public:
+    deferred_release_batch() = default;
+    deferred_release_batch(const deferred_release_batch &) = delete;
+    deferred_release_batch &operator=(const deferred_release_batch &) = delete;
+    ~deferred_release_batch()
+    {
+        flush_deferred_releases();
+    }
+};
+
+/// @brief base class for reference counted objects with deferred release
+/// @tparam T derived class for CRTP
+template <typename T> class refc_deferred : public refc<T> {
+public:
+    struct deferred_refc_policy {
+        static auto add_ref(const refc_deferred *p, unsigned long n = 1) noexcept
+        {
+            return refc<T>::immortal_refc_policy::add_ref(p, n);
+        }
+        static void release(const refc_deferred *p, unsigned long n = 1) noexcept
+        {
+            if (refc<T>::is_immortal(p->rc.load(std::memory_order_relaxed)))
+                return;
+            if (auto t = detail::deferred_releases::local())
+                t->add(p, &release_n, n);
+            else
+                release_n(p, n);
+        }
+        static void release_n(const void *x, unsigned long n) noexcept
+        {
+            auto p = static_cast<const refc_deferred *>(x);
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                delete p;
+            }
+        }
+    };
+    using policy_type = deferred_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+protected:
+    using refc<T>::refc;
+};
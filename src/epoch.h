@@ -0,0 +1,246 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+ Epoch-based reclamation (Fraser, "Practical lock-freedom").
+
+ Readers wrap traversals in an epoch_guard and may follow raw pointers
+ inside it without taking references. Objects are not deleted when their
+ count drops to zero but retired to the current global epoch. The global
+ epoch advances once every thread inside a critical section has observed
+ it, and objects retired two epochs back can no longer be reached by any
+ reader and are deleted.
+
+ Retired objects are kept in per-thread lists, reclaimed every
+ `reclaim_period` retirements and on synchronize(). Lists of exiting
+ threads are handed over to the domain and reclaimed by whoever gets
+ there next.
+*/
+
+class epoch_domain {
+public:
+    using deleter = void (*)(const void *);
+    static constexpr unsigned reclaim_period = 64;
+
+    /// process wide domain
+    static epoch_domain &instance() noexcept
+    {
+        // leaked on purpose, threads may retire objects during static
+        // destruction
+        static auto *d = new epoch_domain;
+        return *d;
+    }
+
+    void enter() noexcept
+    {
+        auto &t = local();
+        if (t.depth++ == 0) {
+            auto g = global.load(std::memory_order_relaxed);
+            t.rec->epoch.store(g << 1 | active, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void exit() noexcept
+    {
+        auto &t = local();
+        if (--t.depth == 0)
+            t.rec->epoch.store(0, std::memory_order_release);
+    }
+
+    /// delete p with del once no reader can still see it
+    void retire(const void *p, deleter del) noexcept
+    {
+        auto &t = local();
+        t.limbo.push_back({ global.load(std::memory_order_relaxed), p, del });
+        if (++t.retired % reclaim_period == 0) {
+            try_advance();
+            reclaim(t);
+        }
+    }
+
+    /// wait until everything retired by this thread and by exited threads
+    /// is deleted, including objects released by those deletions.
+    /// Must not be called inside a critical section.
+    void synchronize() noexcept
+    {
+        auto &t = local();
+        do {
+            auto target = global.load(std::memory_order_relaxed) + 2;
+            while (global.load(std::memory_order_relaxed) < target) {
+                if (!try_advance())
+                    std::this_thread::yield();
+            }
+            reclaim(t, true);
+        } while (!t.limbo.empty());
+    }
+
+    std::uint64_t epoch() const noexcept
+    {
+        return global.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::uint64_t active = 1;
+
+    struct record {
+        // announced epoch << 1 | active, 0 outside critical sections
+        alignas(64) std::atomic<std::uint64_t> epoch{ 0 };
+        std::atomic<bool> in_use{ true };
+        record *next = nullptr;
+    };
+
+    struct retired {
+        std::uint64_t epoch;
+        const void *ptr;
+        deleter del;
+    };
+
+    struct thread_state {
+        record *rec;
+        unsigned depth = 0;
+        unsigned retired = 0;
+        std::vector<epoch_domain::retired> limbo;
+
+        thread_state()
+            : rec(instance().acquire())
+        {}
+        ~thread_state()
+        {
+            auto &d = instance();
+            d.reclaim(*this);
+            if (!limbo.empty()) {
+                std::lock_guard<std::mutex> l(d.orphans_lock);
+                d.orphans.insert(d.orphans.end(), limbo.begin(), limbo.end());
+            }
+            rec->epoch.store(0, std::memory_order_release);
+            rec->in_use.store(false, std::memory_order_release);
+        }
+    };
+
+    static thread_state &local() noexcept
+    {
+        static thread_local thread_state t;
+        return t;
+    }
+
+    epoch_domain() = default;
+
+    record *acquire() noexcept
+    {
+        for (auto r = records.load(std::memory_order_acquire); r; r = r->next) {
+            bool free = false;
+            if (!r->in_use.load(std::memory_order_relaxed) &&
+                r->in_use.compare_exchange_strong(free, true,
+                                                  std::memory_order_acquire))
+                return r;
+        }
+        auto r = new record;
+        r->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(r->next, r,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed)) {
+        }
+        return r;
+    }
+
+    bool try_advance() noexcept
+    {
+        auto g = global.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (auto r = records.load(std::memory_order_acquire); r; r = r->next) {
+            auto e = r->epoch.load(std::memory_order_acquire);
+            if ((e & active) && (e >> 1) != g)
+                return false;
+        }
+        return global.compare_exchange_strong(g, g + 1,
+                                              std::memory_order_acq_rel);
+    }
+
+    static void reclaim_list(std::vector<retired> &list, std::uint64_t g)
+    {
+        std::vector<retired> ready;
+        auto it = std::partition(list.begin(), list.end(), [g](auto &r) {
+            return r.epoch + 2 > g;
+        });
+        ready.assign(it, list.end());
+        list.erase(it, list.end());
+        // deleters may retire more objects
+        for (auto &r : ready)
+            r.del(r.ptr);
+    }
+
+    void reclaim(thread_state &t, bool wait = false) noexcept
+    {
+        auto g = global.load(std::memory_order_acquire);
+        reclaim_list(t.limbo, g);
+        std::unique_lock<std::mutex> l(orphans_lock, std::defer_lock);
+        if (wait)
+            l.lock();
+        else
+            l.try_lock();
+        if (l && !orphans.empty()) {
+            std::vector<retired> mine;
+            mine.swap(orphans);
+            l.unlock();
+            reclaim_list(mine, g);
+            t.limbo.insert(t.limbo.end(), mine.begin(), mine.end());
+        }
+    }
+
+    alignas(64) std::atomic<std::uint64_t> global{ 2 };
+    std::atomic<record *> records{ nullptr };
+    std::mutex orphans_lock;
+    std::vector<retired> orphans;
+};
+
+/// RAII epoch critical section, raw pointers to refc_epoch objects read
+/// inside stay valid until the guard is gone
+class epoch_guard {
+public:
+    epoch_guard() noexcept
+    {
+        epoch_domain::instance().enter();
+    }
+    ~epoch_guard()
+    {
+        epoch_domain::instance().exit();
+    }
+    epoch_guard(const epoch_guard &) = delete;
+    epoch_guard &operator=(const epoch_guard &) = delete;
+};
+
+/// @brief base class for reference counted objects reclaimed through the
+/// epoch domain: the final release retires the object instead of deleting it
+/// @tparam T derived class for CRTP
+template <typename T> class refc_epoch : public refc<T> {
+public:
+    struct epoch_refc_policy {
+        static auto add_ref(const refc_epoch *p, unsigned long n = 1) noexcept
+        {
+            return refc<T>::immortal_refc_policy::add_ref(p, n);
+        }
+        static void release(const refc_epoch *p, unsigned long n = 1) noexcept
+        {
+            if (refc<T>::is_immortal(p->rc.load(std::memory_order_relaxed)))
+                return;
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                epoch_domain::instance().retire(p, [](const void *x) {
+                    delete static_cast<const refc_epoch *>(x);
+                });
+            }
+        }
+    };
+    using policy_type = epoch_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+protected:
+    using refc<T>::refc;
+};
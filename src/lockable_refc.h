@@ -0,0 +1,131 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <thread>
+
+/*
+ Reference counted objects with a lock in the reference count word.
+
+ refc_lockable<T> keeps the count of refc<T> shifted up by two bits and
+ uses the low bits of the same atomic as a lock: bit 0 is the lock itself,
+ bit 1 marks sleeping waiters. Counting is a fetch_add/fetch_sub of whole
+ count units and never looks at the lock bits, locking is a CAS on bit 0
+ that never changes the count, so both stay lock-free and correct under
+ any interleaving. The object gets a BasicLockable lock() / try_lock() /
+ unlock() without growing, on the cache line the count already touches.
+
+ lock() spins briefly, then parks with std::atomic::wait where the library
+ has it (C++20); unlock() notifies only if the waiters bit is set. Without
+ atomic wait, lock() falls back to yielding between attempts.
+
+ The lock is meant for short critical sections; it is not recursive and
+ not fair.
+*/
+
+/// @brief base class for reference counted objects with an embedded lock
+/// @tparam T derived class for CRTP
+template <typename T> class refc_lockable : public refc<T> {
+    using base = refc<T>;
+    static constexpr unsigned long locked_bit = 1;
+    static constexpr unsigned long waiters_bit = 2;
+    static constexpr unsigned count_shift = 2;
+    static constexpr unsigned long count_one = 1ul << count_shift;
+    static constexpr unsigned spin_limit = 64;
+
+public:
+    struct lockable_refc_policy {
+        static auto add_ref(const refc_lockable *p,
+                            unsigned long n = 1) noexcept
+        {
+            auto r = p->rc.load(std::memory_order_relaxed);
+            if (base::is_immortal(r))
+                return r;
+            return p->rc.fetch_add(n * count_one, std::memory_order_relaxed) >>
+                   count_shift;
+        }
+        static void release(const refc_lockable *p,
+                            unsigned long n = 1) noexcept
+        {
+            if (base::is_immortal(p->rc.load(std::memory_order_relaxed)))
+                return;
+            auto r =
+                p->rc.fetch_sub(n * count_one, std::memory_order_release);
+            if (r >> count_shift == n) {
+                assert(!(r & locked_bit) && "last reference dropped locked");
+                std::atomic_thread_fence(std::memory_order_acquire);
+                delete p;
+            }
+        }
+    };
+    using policy_type = lockable_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    constexpr unsigned long refcount() const noexcept
+    {
+        return this->rc.load(std::memory_order_relaxed) >> count_shift;
+    }
+
+    bool try_lock() const noexcept
+    {
+        auto r = this->rc.load(std::memory_order_relaxed);
+        while (!(r & locked_bit)) {
+            if (this->rc.compare_exchange_weak(r, r | locked_bit,
+                                               std::memory_order_acquire,
+                                               std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    void lock() const noexcept
+    {
+        for (unsigned spins = 0; !try_lock(); spins++) {
+            if (spins >= spin_limit)
+                park();
+        }
+    }
+
+    void unlock() const noexcept
+    {
+        auto r = this->rc.fetch_and(~(locked_bit | waiters_bit),
+                                    std::memory_order_release);
+        assert((r & locked_bit) && "unlock of an unlocked object");
+#ifdef __cpp_lib_atomic_wait
+        if (r & waiters_bit)
+            this->rc.notify_all();
+#else
+        (void)r;
+#endif
+    }
+
+    /// for assertions only, the answer may be stale
+    bool is_locked() const noexcept
+    {
+        return this->rc.load(std::memory_order_relaxed) & locked_bit;
+    }
+
+protected:
+    refc_lockable(const refc_lockable &) = delete;
+    refc_lockable &operator=(const refc_lockable &) = delete;
+
+    constexpr refc_lockable() = default;
+    explicit constexpr refc_lockable(refc_immortal_t) noexcept
+        : base(refc_immortal)
+    {}
+
+private:
+    // wait for the holder to unlock
+    void park() const noexcept
+    {
+#ifdef __cpp_lib_atomic_wait
+        auto r = this->rc.fetch_or(waiters_bit, std::memory_order_relaxed) |
+                 waiters_bit;
+        // count changes wake us too early at worst, unlock() clears both bits
+        if (r & locked_bit)
+            this->rc.wait(r, std::memory_order_relaxed);
+#else
+        std::this_thread::yield();
+#endif
+    }
+};
@@ -1,7 +1,81 @@
 #pragma once
 /// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <algorithm>
 #include <type_traits>
 #include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * mixin for (intrusive pointer) types created by allocate_ptr.
+ * Every object is preceded by a small header with its memory resource and size,
+ * so `delete` from a refc release policy (and the weak bases' deferred free,
+ * as long as this is a base of the CRTP class) returns the memory to where it
+ * came from. Plain `new` and make_ptr use the default resource.
+ * The header is kept even for objects from the default resource: delete gets
+ * nothing but the pointer, and a per-type resource couldn't serve allocate_ptr
+ * calls with different resources.
+ * Over-aligned types get the alignment they ask for, the header then sits
+ * right before the object at the start of an alignment sized gap.
+ * Types that don't derive from it pay nothing.
+ */
+struct pmr_allocated {
+private:
+    struct alignas(std::max_align_t) header {
+        std::pmr::memory_resource* resource;
+        std::size_t size;
+    };
+    static constexpr std::size_t header_offset(std::size_t align) noexcept {
+        return align > sizeof(header) ? align : sizeof(header);
+    }
+public:
+    /// bytes allocated from the resource for an object of `size` bytes
+    static constexpr std::size_t allocation_size(std::size_t size,
+                                                 std::size_t align = alignof(header)) noexcept {
+        auto a = align > alignof(header) ? align : alignof(header);
+        return (header_offset(a) + size + a - 1) / a * a;
+    }
+
+    static void* operator new(std::size_t size) {
+        return operator new(size, std::pmr::get_default_resource());
+    }
+    static void* operator new(std::size_t size, std::align_val_t align) {
+        return operator new(size, align, std::pmr::get_default_resource());
+    }
+    static void* operator new(std::size_t size, std::pmr::memory_resource* r) {
+        return operator new(size, std::align_val_t(alignof(header)), r);
+    }
+    static void* operator new(std::size_t size, std::align_val_t align,
+                              std::pmr::memory_resource* r) {
+        auto a = std::max(static_cast<std::size_t>(align), alignof(header));
+        auto p = static_cast<char*>(r->allocate(header_offset(a) + size, a)) + header_offset(a);
+        auto h = reinterpret_cast<header*>(p) - 1;
+        h->resource = r;
+        h->size = size;
+        return p;
+    }
+    static void operator delete(void* p) noexcept {
+        operator delete(p, std::align_val_t(alignof(header)));
+    }
+    static void operator delete(void* p, std::align_val_t align) noexcept {
+        if (!p)
+            return;
+        auto a = std::max(static_cast<std::size_t>(align), alignof(header));
+        auto h = static_cast<header*>(p) - 1;
+        h->resource->deallocate(static_cast<char*>(p) - header_offset(a),
+                                header_offset(a) + h->size, a);
+    }
+    // called if the constructor throws in allocate_ptr
+    static void operator delete(void* p, std::pmr::memory_resource*) noexcept {
+        operator delete(p);
+    }
+    static void operator delete(void* p, std::align_val_t align,
+                                std::pmr::memory_resource*) noexcept {
+        operator delete(p, align);
+    }
+};
 
 namespace detail {
 
@@ -40,6 +114,76 @@ struct mp <R, Ptr, true, Args...> {
     }
 };
 
+// allocate_ptr counterpart of mp: allocate_shared for shared_ptr,
+// pmr_allocated placement new for everything else
+inline std::pmr::memory_resource* resource_of(std::pmr::memory_resource* r) {
+    return r;
+}
+
+template <typename T>
+std::pmr::memory_resource* resource_of(const std::pmr::polymorphic_allocator<T>& a) {
+    return a.resource();
+}
+
+template <typename R, typename Ptr, typename Alloc, bool spec = is_shared_ptr<typename R::ptr>::value, typename ...Args>
+struct ap {
+    Ptr operator()(const Alloc& alloc, Args&& ...args) {
+        static_assert(std::is_base_of_v<pmr_allocated, R>,
+                      "allocate_ptr needs intrusive types derived from pmr_allocated");
+        return Ptr{new (resource_of(alloc)) R(std::forward<Args>(args)...)};
+    }
+};
+
+template <typename R, typename Ptr, typename Alloc, typename ...Args>
+struct ap <R, Ptr, Alloc, true, Args...> {
+    Ptr operator()(const Alloc& alloc, Args&&... args) {
+        if constexpr (std::is_convertible_v<Alloc, std::pmr::memory_resource*>)
+            return std::allocate_shared<R>(std::pmr::polymorphic_allocator<R>(alloc),
+                                           std::forward<Args>(args)...);
+        else
+            return std::allocate_shared<R>(alloc, std::forward<Args>(args)...);
+    }
+};
+
+// memory for make_ptr_n: one block with room for n pmr_allocated objects,
+// freeing itself when the last of them is gone
+class block_resource : public std::pmr::memory_resource {
+public:
+    static block_resource* create(std::size_t bytes) {
+        auto mem = ::operator new(sizeof(block_resource) + bytes);
+        return new (mem) block_resource(bytes);
+    }
+    // drop the reference held while the objects are being created
+    void release() noexcept {
+        if (live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~block_resource();
+            ::operator delete(this);
+        }
+    }
+private:
+    explicit block_resource(std::size_t bytes)
+        : top(reinterpret_cast<char*>(this + 1)), end(top + bytes) {}
+
+    void* do_allocate(std::size_t bytes, std::size_t align) override {
+        auto p = top + (-reinterpret_cast<std::uintptr_t>(top) & (align - 1));
+        if (p + bytes > end)
+            throw std::bad_alloc();
+        top = p + bytes;
+        live.fetch_add(1, std::memory_order_relaxed);
+        return p;
+    }
+    void do_deallocate(void*, std::size_t, std::size_t) override {
+        release();
+    }
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    alignas(std::max_align_t) std::atomic<std::size_t> live{1};
+    char* top;
+    char* end;
+};
+
 template <int i> struct prio: prio<i - 1> {};
 template <> struct prio<0> {};
 
@@ -58,6 +202,18 @@ make_ptr_(prio<1>, Args&&... args) {
     return detail::mp<R, typename R::template ptr_templ<R>, detail::is_shared_ptr<typename R::template ptr_templ<R>>::value, Args...>{}(std::forward<Args>(args)...);
 }
 
+template <typename R, typename Alloc, typename ...Args>
+typename R::ptr
+allocate_ptr_(prio<0>, const Alloc& alloc, Args&&... args) {
+    return detail::ap<R, typename R::ptr, Alloc, detail::is_shared_ptr<typename R::ptr>::value, Args...>{}(alloc, std::forward<Args>(args)...);
+}
+
+template <typename R, typename Alloc, typename ...Args>
+typename R::template ptr_templ<R>
+allocate_ptr_(prio<1>, const Alloc& alloc, Args&&... args) {
+    return detail::ap<R, typename R::template ptr_templ<R>, Alloc, detail::is_shared_ptr<typename R::template ptr_templ<R>>::value, Args...>{}(alloc, std::forward<Args>(args)...);
+}
+
 } // end detail namespace
 
 
@@ -79,3 +235,49 @@ template <typename R, typename ...Args>
 auto make_ptr(Args&&... args) {
     return detail::make_ptr_<R, Args...>(detail::prio<1>{}, std::forward<Args>(args)...);
 }
+
+/**
+ * make_ptr with memory from an allocator, like std::allocate_shared.
+ * shared_ptr types take any allocator or a std::pmr::memory_resource*,
+ * intrusive types a memory_resource* or polymorphic_allocator and must derive
+ * from pmr_allocated.
+ *
+ * Example:
+ * @code {.cpp}
+ * struct node : public refc<node>, public pmr_allocated {};
+ * std::pmr::monotonic_buffer_resource arena;
+ * auto p = allocate_ptr<node>(&arena); // returns node::ptr
+ * @endcode
+ */
+template <typename R, typename Alloc, typename ...Args>
+auto allocate_ptr(const Alloc& alloc, Args&&... args) {
+    return detail::allocate_ptr_<R, Alloc, Args...>(detail::prio<1>{}, alloc, std::forward<Args>(args)...);
+}
+
+/**
+ * create n objects of R in one contiguous block, like make_ptr(args...) for
+ * each of them. Objects are reference counted independently, the block is
+ * freed with the last one. R must be an intrusive type derived from
+ * pmr_allocated (each object keeps a pointer to its block).
+ *
+ * @return std::vector of R::ptr (or R::ptr_templ<R>) in address order
+ */
+template <typename R, typename ...Args>
+auto make_ptr_n(std::size_t n, const Args&... args) {
+    using ptr = decltype(detail::make_ptr_<R>(detail::prio<1>{}));
+    static_assert(!detail::is_shared_ptr<ptr>::value && std::is_base_of_v<pmr_allocated, R>,
+                  "make_ptr_n needs intrusive types derived from pmr_allocated");
+    std::vector<ptr> objects;
+    objects.reserve(n);
+    // room to align the first object when R is over-aligned
+    auto slack = alignof(R) > alignof(std::max_align_t) ? alignof(R) : 0;
+    auto block = detail::block_resource::create(
+        n * pmr_allocated::allocation_size(sizeof(R), alignof(R)) + slack);
+    struct guard {
+        detail::block_resource* b;
+        ~guard() { b->release(); }
+    } g{block};
+    for (std::size_t i = 0; i < n; i++)
+        objects.push_back(ptr{new (static_cast<std::pmr::memory_resource*>(block)) R(args...)});
+    return objects;
+}
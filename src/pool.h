@@ -0,0 +1,341 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/*
+ Slab pool for small, high-churn objects.
+
+ Memory comes in 64KB slabs aligned to their size. Each slab serves a
+ single 16-byte size class and keeps the class in a header at its start,
+ so deallocate() needs nothing but the pointer, which is all the weak
+ bases have left once the object is destroyed.
+ Freed blocks go to a thread-local free list per size class; lists that
+ grow past `cache_limit` keep the most recently used half and spill the
+ rest to a shared list.
+ Requests above `max_block` get a dedicated slab-aligned allocation.
+ Alignments above 16 bytes round the size class up to a multiple of the
+ alignment (up to 64, the header size) or take the large path.
+ Once a thread's cache is destroyed, later frees and allocations on that
+ thread (from other thread_local or static destructors) use the shared
+ lists directly.
+
+ Slabs are never returned to the system, `bytes_held` counts them.
+
+ Classes opt in by deriving from pool_allocated, which gives them (and
+ their subclasses) class-specific operator new/delete, so plain `new`,
+ make_ptr and refc_policy's `delete` all go through the pool. The weak
+ bases in ptr.h free storage through T::operator delete, T being the CRTP
+ parameter, so pool_allocated has to be a base of that class.
+*/
+
+class slab_pool {
+public:
+    static constexpr std::size_t slab_size = 64 * 1024;
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t max_block = 1024;
+    static constexpr std::size_t class_count = max_block / granularity;
+    static constexpr std::size_t cache_limit = 256;
+
+    struct stats {
+        std::uint64_t hits;   // served from a free list
+        std::uint64_t misses; // needed a new slab or a large allocation
+        std::uint64_t bytes_held;
+    };
+
+    static void *allocate(std::size_t size,
+                          std::size_t align = alignof(std::max_align_t))
+    {
+        if (align > alignof(slab_header))
+            return allocate_large(size, align);
+        if (align > granularity)
+            size = (size + align - 1) & ~(align - 1);
+        if (size > max_block)
+            return allocate_large(size);
+        auto cls = size ? (size - 1) / granularity : 0;
+        auto c = local();
+        if (!c)
+            return allocate_shared(cls);
+        auto &list = c->lists[cls];
+        if (!list.head && !refill(cls, list)) {
+            new_slab(cls, list);
+            c->bump(c->misses);
+        } else {
+            c->bump(c->hits);
+        }
+        auto b = list.head;
+        list.head = b->next;
+        list.count--;
+        return b;
+    }
+
+    static void deallocate(void *p) noexcept
+    {
+        if (!p)
+            return;
+        auto h = header_of(p);
+        if (h->size_class == large) {
+            global().bytes_held.fetch_sub(h->bytes, std::memory_order_relaxed);
+            ::operator delete(h, std::align_val_t(slab_size));
+            return;
+        }
+        auto b = static_cast<block *>(p);
+        auto c = local();
+        if (!c) {
+            auto &g = global();
+            std::lock_guard<std::mutex> l(g.lock);
+            auto &list = g.lists[h->size_class];
+            b->next = list.head;
+            list.head = b;
+            list.count++;
+            return;
+        }
+        auto &list = c->lists[h->size_class];
+        b->next = list.head;
+        list.head = b;
+        if (++list.count > cache_limit)
+            spill(h->size_class, list);
+    }
+
+    static stats get_stats() noexcept
+    {
+        auto &g = global();
+        std::lock_guard<std::mutex> l(g.lock);
+        stats s{ g.hits, g.misses,
+                 g.bytes_held.load(std::memory_order_relaxed) };
+        for (auto c : g.caches) {
+            s.hits += c->hits.load(std::memory_order_relaxed);
+            s.misses += c->misses.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+private:
+    static constexpr std::uint32_t large = ~std::uint32_t(0);
+
+    struct alignas(64) slab_header {
+        std::uint32_t size_class;
+        std::size_t bytes;
+    };
+
+    struct block {
+        block *next;
+    };
+
+    struct free_list {
+        block *head = nullptr;
+        std::size_t count = 0;
+    };
+
+    struct thread_cache {
+        free_list lists[class_count];
+        // written by the owning thread only, read by get_stats()
+        std::atomic<std::uint64_t> hits{ 0 };
+        std::atomic<std::uint64_t> misses{ 0 };
+
+        thread_cache()
+        {
+            auto &g = global();
+            std::lock_guard<std::mutex> l(g.lock);
+            g.caches.push_back(this);
+        }
+        ~thread_cache()
+        {
+            auto &g = global();
+            for (std::size_t cls = 0; cls < class_count; cls++)
+                spill(cls, lists[cls], true);
+            tls_exited = true;
+            std::lock_guard<std::mutex> l(g.lock);
+            g.hits += hits.load(std::memory_order_relaxed);
+            g.misses += misses.load(std::memory_order_relaxed);
+            for (auto &c : g.caches) {
+                if (c == this) {
+                    c = g.caches.back();
+                    g.caches.pop_back();
+                    break;
+                }
+            }
+        }
+        void bump(std::atomic<std::uint64_t> &counter) noexcept
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+        }
+    };
+
+    struct shared_state {
+        std::mutex lock;
+        free_list lists[class_count];
+        std::vector<thread_cache *> caches;
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::atomic<std::uint64_t> bytes_held{ 0 };
+    };
+
+    static shared_state &global() noexcept
+    {
+        // leaked on purpose, pooled objects may die during static destruction
+        static auto *g = new shared_state;
+        return *g;
+    }
+
+    static inline thread_local bool tls_exited = false;
+
+    /// cache of the calling thread, nullptr once it has been torn down
+    static thread_cache *local() noexcept
+    {
+        if (tls_exited)
+            return nullptr;
+        static thread_local thread_cache c;
+        return &c;
+    }
+
+    static void count_miss() noexcept
+    {
+        if (auto c = local()) {
+            c->bump(c->misses);
+        } else {
+            auto &g = global();
+            std::lock_guard<std::mutex> l(g.lock);
+            g.misses++;
+        }
+    }
+
+    // allocation without a thread cache, straight from the shared list
+    static void *allocate_shared(std::size_t cls)
+    {
+        auto &g = global();
+        {
+            std::lock_guard<std::mutex> l(g.lock);
+            auto &from = g.lists[cls];
+            if (auto b = from.head) {
+                from.head = b->next;
+                from.count--;
+                g.hits++;
+                return b;
+            }
+            g.misses++;
+        }
+        free_list list;
+        new_slab(cls, list);
+        auto b = list.head;
+        list.head = b->next;
+        list.count--;
+        spill(cls, list, true);
+        return b;
+    }
+
+    static slab_header *header_of(void *p) noexcept
+    {
+        return reinterpret_cast<slab_header *>(
+            reinterpret_cast<std::uintptr_t>(p) & ~(slab_size - 1));
+    }
+
+    // dedicated allocation, the block follows the header at the first
+    // multiple of align so header_of() still finds it
+    static void *allocate_large(std::size_t size,
+                                std::size_t align = alignof(slab_header))
+    {
+        auto offset = std::max(sizeof(slab_header), align);
+        if (offset >= slab_size)
+            throw std::bad_alloc();
+        auto bytes = (offset + size + slab_size - 1) & ~(slab_size - 1);
+        auto h = static_cast<slab_header *>(
+            ::operator new(bytes, std::align_val_t(slab_size)));
+        h->size_class = large;
+        h->bytes = bytes;
+        count_miss();
+        global().bytes_held.fetch_add(bytes, std::memory_order_relaxed);
+        return reinterpret_cast<char *>(h) + offset;
+    }
+
+    static void new_slab(std::size_t cls, free_list &list)
+    {
+        auto h = static_cast<slab_header *>(
+            ::operator new(slab_size, std::align_val_t(slab_size)));
+        h->size_class = static_cast<std::uint32_t>(cls);
+        h->bytes = slab_size;
+        global().bytes_held.fetch_add(slab_size, std::memory_order_relaxed);
+        auto size = (cls + 1) * granularity;
+        auto first = reinterpret_cast<char *>(h + 1);
+        auto end = reinterpret_cast<char *>(h) + slab_size;
+        for (auto p = first; p + size <= end; p += size) {
+            auto b = reinterpret_cast<block *>(p);
+            b->next = list.head;
+            list.head = b;
+            list.count++;
+        }
+        spill(cls, list);
+    }
+
+    // take up to half a cache worth of blocks from the shared list
+    static bool refill(std::size_t cls, free_list &list) noexcept
+    {
+        auto &g = global();
+        std::lock_guard<std::mutex> l(g.lock);
+        auto &from = g.lists[cls];
+        for (std::size_t n = 0; from.head && n < cache_limit / 2; n++) {
+            auto b = from.head;
+            from.head = b->next;
+            from.count--;
+            b->next = list.head;
+            list.head = b;
+            list.count++;
+        }
+        return list.head;
+    }
+
+    // move all but the most recently freed half cache worth of a thread's
+    // blocks (or all of them) to the shared list
+    static void spill(std::size_t cls, free_list &list, bool all = false) noexcept
+    {
+        auto keep = all ? 0 : cache_limit / 2;
+        if (list.count <= keep)
+            return;
+        block *first = list.head, **cut = &list.head;
+        if (keep) {
+            auto last = list.head;
+            for (std::size_t n = 1; n < keep; n++)
+                last = last->next;
+            first = last->next;
+            cut = &last->next;
+        }
+        auto tail = first;
+        while (tail->next)
+            tail = tail->next;
+        auto moved = list.count - keep;
+        *cut = nullptr;
+        list.count = keep;
+        auto &g = global();
+        std::lock_guard<std::mutex> l(g.lock);
+        auto &to = g.lists[cls];
+        tail->next = to.head;
+        to.head = first;
+        to.count += moved;
+    }
+};
+
+/// derive from this to allocate a class and its subclasses from slab_pool
+struct pool_allocated {
+    static void *operator new(std::size_t size)
+    {
+        return slab_pool::allocate(size);
+    }
+    static void *operator new(std::size_t size, std::align_val_t align)
+    {
+        return slab_pool::allocate(size, static_cast<std::size_t>(align));
+    }
+    static void operator delete(void *p) noexcept
+    {
+        slab_pool::deallocate(p);
+    }
+    static void operator delete(void *p, std::align_val_t) noexcept
+    {
+        slab_pool::deallocate(p);
+    }
+};
@@ -1,8 +1,85 @@
 #pragma once
 /// Copyright (c) 2018 Vassily Checkin. See included license file.
 #include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <thread>
 #include <type_traits>
 
+/// refc_local objects record the creating thread and assert on use from
+/// any other thread. On by default in debug builds.
+#ifndef REFC_LOCAL_CHECK_THREAD
+#ifdef NDEBUG
+#define REFC_LOCAL_CHECK_THREAD 0
+#else
+#define REFC_LOCAL_CHECK_THREAD 1
+#endif
+#endif
+
+/// refc_ref asserts that the object it points to is still referenced on
+/// every access. On by default in debug builds.
+#ifndef REFC_REF_CHECK
+#ifdef NDEBUG
+#define REFC_REF_CHECK 0
+#else
+#define REFC_REF_CHECK 1
+#endif
+#endif
+
+namespace detail {
+template <typename T, typename = void>
+struct has_refcount : std::false_type {};
+template <typename T>
+struct has_refcount<
+    T, std::void_t<decltype(std::declval<const T &>().refcount())>>
+    : std::true_type {};
+
+/// bases whose refcount() is only approximate off the owning thread or
+/// while live (refc_biased, refc_sharded) declare approximate_refcount
+template <typename T, typename = void>
+struct has_exact_refcount : has_refcount<T> {};
+template <typename T>
+struct has_exact_refcount<T, std::enable_if_t<T::approximate_refcount>>
+    : std::false_type {};
+
+template <typename Policy, typename T, typename = void>
+struct has_counted_ops : std::false_type {};
+template <typename Policy, typename T>
+struct has_counted_ops<
+    Policy, T,
+    std::void_t<decltype(Policy::add_ref(std::declval<T *>(), 2)),
+                decltype(Policy::release(std::declval<T *>(), 2))>>
+    : std::true_type {};
+
+/// n references at once, through the counted policy API (a single atomic
+/// for the built-in policies) or one by one for policies without it
+template <typename Policy, typename T>
+void add_refs(T *p, unsigned long n) noexcept
+{
+    if constexpr (has_counted_ops<Policy, T>::value) {
+        if (n)
+            Policy::add_ref(p, n);
+    } else {
+        for (; n > 0; n--)
+            Policy::add_ref(p);
+    }
+}
+
+template <typename Policy, typename T>
+void release_refs(T *p, unsigned long n) noexcept
+{
+    if constexpr (has_counted_ops<Policy, T>::value) {
+        if (n)
+            Policy::release(p, n);
+    } else {
+        for (; n > 0; n--)
+            Policy::release(p);
+    }
+}
+} // namespace detail
+
 /// shared pointer with intrusive reference counting
 /// @tparam T pointed to type (element_type) 
 /// @tparam P reference counting policy
@@ -188,6 +265,70 @@ private:
     T *ptr = nullptr;
 };
 
+/// borrowed, non-owning view of a reference counted object for function
+/// parameters: converts from refc_ptr and T& without touching the count.
+/// The caller's reference has to outlive the call; retain() makes an owning
+/// pointer when the callee needs to keep the object.
+/// Debug builds (REFC_REF_CHECK) assert that the object is still referenced
+/// on every access, for types whose refcount() is exact.
+template <typename T, typename Policy = typename T::policy_type>
+class refc_ref {
+public:
+    using element_type = T;
+    using policy = Policy;
+
+    constexpr refc_ref() noexcept = default;
+    constexpr refc_ref(std::nullptr_t) noexcept
+    {}
+    template <typename U,
+              typename = std::enable_if_t<std::is_convertible<U *, T *>::value>>
+    refc_ref(const refc_ptr<U, Policy> &p) noexcept
+        : ptr(p.get())
+    {}
+    refc_ref(T &x) noexcept
+        : ptr(&x)
+    {
+        check();
+    }
+
+    T *get() const noexcept
+    {
+        check();
+        return ptr;
+    }
+    T *operator->() const noexcept
+    {
+        return get();
+    }
+    T &operator*() const noexcept
+    {
+        return *get();
+    }
+    explicit operator bool() const noexcept
+    {
+        return ptr != nullptr;
+    }
+
+    /// take a reference of our own
+    refc_ptr<T, Policy> retain() const noexcept
+    {
+        return refc_ptr<T, Policy>(get());
+    }
+
+private:
+    void check() const noexcept
+    {
+#if REFC_REF_CHECK
+        if constexpr (detail::has_exact_refcount<T>::value) {
+            assert((!ptr || ptr->refcount() != 0) &&
+                   "refc_ref to an object that is not referenced");
+        }
+#endif
+    }
+
+    T *ptr = nullptr;
+};
+
 template <class T, class U>
 inline bool operator==(const refc_ptr<T> &a, const refc_ptr<U> &b) noexcept
 {
@@ -278,24 +419,91 @@ template <class T, class U> refc_ptr<T> dynamic_pointer_cast(refc_ptr<U> &&p)
 #endif
 }
 
+/// tag for constructing immortal objects, see refc<T>
+struct refc_immortal_t {
+    explicit constexpr refc_immortal_t() = default;
+};
+inline constexpr refc_immortal_t refc_immortal{};
+
+namespace detail {
+template <typename T, typename = void>
+struct has_class_delete : std::false_type {};
+template <typename T>
+struct has_class_delete<
+    T, std::void_t<decltype(T::operator delete(static_cast<void *>(nullptr)))>>
+    : std::true_type {};
+
+template <typename T, typename = void>
+struct has_class_aligned_delete : std::false_type {};
+template <typename T>
+struct has_class_aligned_delete<
+    T, std::void_t<decltype(T::operator delete(static_cast<void *>(nullptr),
+                                               std::align_val_t{}))>>
+    : std::true_type {};
+
+/// give back the storage of an already destroyed object, through T's own
+/// operator delete if it has one (see pool_allocated in pool.h), the way
+/// delete would for T's alignment
+template <typename T> void deallocate(const void *p) noexcept
+{
+    auto x = const_cast<void *>(p);
+    if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        std::align_val_t a{ alignof(T) };
+        if constexpr (has_class_aligned_delete<T>::value)
+            T::operator delete(x, a);
+        else if constexpr (has_class_delete<T>::value)
+            T::operator delete(x);
+        else
+            ::operator delete(x, a);
+    } else if constexpr (has_class_delete<T>::value) {
+        T::operator delete(x);
+    } else {
+        ::operator delete(x);
+    }
+}
+} // namespace detail
+
 /// @brief base class for reference counted objects
+/// Objects constructed with refc_immortal get a count so far from zero that
+/// they are never deleted, which suits sentinels and defaults with static
+/// storage duration. The constructor is constexpr, so such objects are
+/// constant initialized (`constinit` in C++20). refc_policy still writes
+/// their count; immortal_refc_policy checks for it first and leaves the
+/// cache line alone, at the cost of a load and a branch per operation on
+/// every object.
 /// @tparam T derived class for CRTP
 template <typename T> class refc {
 public:
     // default reference counting policy for refc_ptr with `delete p` on release
     struct refc_policy {
-        static auto add_ref(const refc *p) noexcept
+        static auto add_ref(const refc *p, unsigned long n = 1) noexcept
         {
-            return p->rc.fetch_add(1, std::memory_order_relaxed);
+            return p->rc.fetch_add(n, std::memory_order_relaxed);
         }
-        static void release(const refc *p) noexcept
+        static void release(const refc *p, unsigned long n = 1) noexcept
         {
-            if (p->rc.fetch_sub(1, std::memory_order_release) == 1) {
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
                 std::atomic_thread_fence(std::memory_order_acquire);
                 delete p;
             }
         }
     };
+    // refc_policy that never writes the count of immortal objects, for
+    // types whose immortal instances are shared between threads
+    struct immortal_refc_policy {
+        static auto add_ref(const refc *p, unsigned long n = 1) noexcept
+        {
+            auto r = p->rc.load(std::memory_order_relaxed);
+            if (is_immortal(r))
+                return r;
+            return refc_policy::add_ref(p, n);
+        }
+        static void release(const refc *p, unsigned long n = 1) noexcept
+        {
+            if (!is_immortal(p->rc.load(std::memory_order_relaxed)))
+                refc_policy::release(p, n);
+        }
+    };
     using policy_type = refc_policy;
     using ptr = refc_ptr<T, policy_type>;
     using cptr = refc_ptr<const T, policy_type>;
@@ -316,33 +524,113 @@ protected:
     refc &operator=(const refc &) = delete;
 
     constexpr refc() = default;
+    explicit constexpr refc(refc_immortal_t) noexcept
+        : rc{ immortal_count }
+    {}
 
     virtual ~refc() = default;
+
+    // top two bits set; anything with the top bit set counts as immortal, so
+    // a racing fetch_add/fetch_sub that slipped past the check is harmless
+    static constexpr unsigned long immortal_count = ~0ul - (~0ul >> 2);
+    static constexpr bool is_immortal(unsigned long count) noexcept
+    {
+        return count > (~0ul >> 1);
+    }
+
+    mutable std::atomic<unsigned long> rc{ 0 };
+};
+
+/// @brief base class for reference counted objects without a vtable
+/// Same interface as refc<T>, but the destructor is not virtual and the
+/// release policy deletes through `static_cast<const T *>`, saving the vptr
+/// and the indirect call. Every object must be a T: T has to be final or
+/// have a virtual destructor of its own, which is checked at compile time.
+/// Only T can construct the base, so no class between refc_nonvirtual<T>
+/// and T can be created on its own and then deleted as a T. For a hierarchy
+/// whose base is used through pointers, make that base T and give it a
+/// virtual destructor, then derive from it.
+/// @tparam T derived class for CRTP
+template <typename T> class refc_nonvirtual {
+public:
+    struct refc_policy {
+        static auto add_ref(const refc_nonvirtual *p,
+                            unsigned long n = 1) noexcept
+        {
+            return p->rc.fetch_add(n, std::memory_order_relaxed);
+        }
+        static void release(const refc_nonvirtual *p,
+                            unsigned long n = 1) noexcept
+        {
+            static_assert(std::is_final_v<T> ||
+                              std::has_virtual_destructor_v<T>,
+                          "refc_nonvirtual<T> deletes as T, make T final or "
+                          "give it a virtual destructor");
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                delete static_cast<const T *>(p);
+            }
+        }
+    };
+    using policy_type = refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    constexpr unsigned long refcount() const noexcept
+    {
+        return rc.load(std::memory_order_relaxed);
+    }
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_nonvirtual<T>, Y>,
+                               bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+protected:
+    refc_nonvirtual(const refc_nonvirtual &) = delete;
+    refc_nonvirtual &operator=(const refc_nonvirtual &) = delete;
+
+    ~refc_nonvirtual() = default;
+
     mutable std::atomic<unsigned long> rc{ 0 };
+
+private:
+    friend T;
+    constexpr refc_nonvirtual() = default;
 };
 
 /// Base class for reference counted objects with weak references
+/// Like refc<T>, immortal objects are safe with the default policies, and
+/// immortal_strong_refc_policy / immortal_weak_refc_policy skip writing
+/// their counts at the cost of a load and a branch on every object.
 /// @tparam T derived type for CRTP
 template <typename T> class refc_weak_base : public refc<T> {
+    using refc<T>::is_immortal;
+
 public:
     struct weak_refc_policy {
-        static auto add_ref(const refc_weak_base *x) noexcept
+        static auto add_ref(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
         {
-            return x->weak_rc.fetch_add(1, std::memory_order_relaxed);
+            return x->weak_rc.fetch_add(n, std::memory_order_relaxed);
         }
-        static void release(const refc_weak_base *x) noexcept
+        static void release(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
         {
-            if (x->weak_rc.fetch_sub(1, std::memory_order_release) == 1) {
-                ::operator delete(const_cast<refc_weak_base *>(x));
+            if (x->weak_rc.fetch_sub(n, std::memory_order_release) == n) {
+                detail::deallocate<T>(x);
             }
         }
     };
 
     struct strong_refc_policy {
-        static auto add_ref(const refc_weak_base *x) noexcept
+        static auto add_ref(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
         {
-            x->weak_rc.fetch_add(1, std::memory_order_relaxed);
-            return x->rc.fetch_add(1, std::memory_order_relaxed);
+            x->weak_rc.fetch_add(n, std::memory_order_relaxed);
+            return x->rc.fetch_add(n, std::memory_order_relaxed);
         }
         static auto try_ref(const refc_weak_base *x) noexcept
         {
@@ -356,21 +644,289 @@ public:
             x->weak_rc.fetch_sub(1, std::memory_order_relaxed);
             return r;
         }
-        static void release(const refc_weak_base *x) noexcept
+        static void release(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
         {
-            if (x->rc.fetch_sub(1, std::memory_order_release) == 1) {
+            if (x->rc.fetch_sub(n, std::memory_order_release) == n) {
                 std::atomic_thread_fence(std::memory_order_acquire);
                 std::destroy_at(x);
             }
-            if (x->weak_rc.fetch_sub(1, std::memory_order_release) == 1) {
-                ::operator delete(const_cast<refc_weak_base *>(x));
+            if (x->weak_rc.fetch_sub(n, std::memory_order_release) == n) {
+                detail::deallocate<T>(x);
             }
         }
     };
+
+    // policies that never write the counts of immortal objects
+    struct immortal_weak_refc_policy {
+        static auto add_ref(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            auto r = x->weak_rc.load(std::memory_order_relaxed);
+            if (is_immortal(r))
+                return r;
+            return weak_refc_policy::add_ref(x, n);
+        }
+        static void release(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            if (!is_immortal(x->weak_rc.load(std::memory_order_relaxed)))
+                weak_refc_policy::release(x, n);
+        }
+    };
+    struct immortal_strong_refc_policy {
+        static auto add_ref(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            auto r = x->rc.load(std::memory_order_relaxed);
+            if (is_immortal(r))
+                return r;
+            return strong_refc_policy::add_ref(x, n);
+        }
+        static auto try_ref(const refc_weak_base *x) noexcept
+        {
+            auto r = x->rc.load(std::memory_order_relaxed);
+            if (is_immortal(r))
+                return r;
+            return strong_refc_policy::try_ref(x);
+        }
+        static void release(const refc_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            if (!is_immortal(x->rc.load(std::memory_order_relaxed)))
+                strong_refc_policy::release(x, n);
+        }
+    };
+
     using policy_type = strong_refc_policy;
     using weak_policy_type = weak_refc_policy;
 
 protected:
     using refc<T>::refc;
+    explicit constexpr refc_weak_base(refc_immortal_t) noexcept
+        : refc<T>(refc_immortal)
+        , weak_rc{ refc<T>::immortal_count }
+    {}
     mutable std::atomic<unsigned long> weak_rc{ 0 };
 };
+
+
+/// Base class for reference counted objects with weak references that keeps
+/// strong and weak counts in a single 64-bit word, so every reference count
+/// operation is one atomic RMW (or one CAS loop for try_ref).
+/// Strong references collectively hold one weak reference, which is dropped
+/// after the object is destroyed. Each count is limited to 2^32 - 1.
+/// @tparam T derived type for CRTP
+template <typename T> class refc_packed_weak_base {
+    static constexpr std::uint64_t strong_one = 1;
+    static constexpr std::uint64_t weak_one = std::uint64_t(1) << 32;
+    static constexpr std::uint64_t strong_mask = weak_one - 1;
+
+public:
+    struct weak_refc_policy {
+        static auto add_ref(const refc_packed_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            return x->rc.fetch_add(n * weak_one, std::memory_order_relaxed) >>
+                   32;
+        }
+        static void release(const refc_packed_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            auto r = x->rc.fetch_sub(n * weak_one, std::memory_order_release);
+            if (r >> 32 == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                detail::deallocate<T>(x);
+            }
+        }
+    };
+
+    struct strong_refc_policy {
+        static auto add_ref(const refc_packed_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            return x->rc.fetch_add(n * strong_one, std::memory_order_relaxed) &
+                   strong_mask;
+        }
+        static auto try_ref(const refc_packed_weak_base *x) noexcept
+        {
+            auto r = x->rc.load(std::memory_order_relaxed);
+            while (r & strong_mask) {
+                if (x->rc.compare_exchange_weak(r, r + strong_one,
+                                                std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            return r & strong_mask;
+        }
+        static void release(const refc_packed_weak_base *x,
+                            std::uint64_t n = 1) noexcept
+        {
+            if ((x->rc.fetch_sub(n * strong_one, std::memory_order_release) &
+                 strong_mask) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                x->~refc_packed_weak_base();
+                weak_refc_policy::release(x);
+            }
+        }
+    };
+    using policy_type = strong_refc_policy;
+    using weak_policy_type = weak_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    constexpr unsigned long refcount() const noexcept
+    {
+        return rc.load(std::memory_order_relaxed) & strong_mask;
+    }
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_packed_weak_base<T>, Y>,
+                               bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+protected:
+    refc_packed_weak_base(const refc_packed_weak_base &) = delete;
+    refc_packed_weak_base &operator=(const refc_packed_weak_base &) = delete;
+
+    constexpr refc_packed_weak_base() = default;
+
+    virtual ~refc_packed_weak_base() = default;
+    // strong count in the low half, weak count in the high half
+    mutable std::atomic<std::uint64_t> rc{ weak_one };
+};
+
+/// @brief base class for reference counted objects confined to one thread
+/// Same interface as refc<T>, but the counter is a plain integer, so
+/// copying and destroying pointers involves no locked instructions.
+/// @tparam T derived class for CRTP
+template <typename T> class refc_local {
+public:
+    // non-atomic reference counting policy with `delete p` on release
+    struct refc_policy {
+        static auto add_ref(const refc_local *p, unsigned long n = 1) noexcept
+        {
+            p->check_thread();
+            auto r = p->rc;
+            p->rc += n;
+            return r;
+        }
+        static void release(const refc_local *p, unsigned long n = 1) noexcept
+        {
+            p->check_thread();
+            if ((p->rc -= n) == 0) {
+                delete p;
+            }
+        }
+    };
+    using policy_type = refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    constexpr unsigned long refcount() const noexcept
+    {
+        return rc;
+    }
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_local<T>, Y>, bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+    /// make the calling thread the owner, e.g. after handing a freshly
+    /// built object graph over to a worker. No-op without thread checks.
+    void adopt_thread() noexcept
+    {
+#if REFC_LOCAL_CHECK_THREAD
+        owner = std::this_thread::get_id();
+#endif
+    }
+
+protected:
+    refc_local(const refc_local &) = delete;
+    refc_local &operator=(const refc_local &) = delete;
+
+    constexpr refc_local() = default;
+
+    virtual ~refc_local() = default;
+
+    void check_thread() const noexcept
+    {
+#if REFC_LOCAL_CHECK_THREAD
+        assert(owner == std::this_thread::get_id() &&
+               "refc_local object used from a foreign thread");
+#endif
+    }
+
+    mutable unsigned long rc = 0;
+#if REFC_LOCAL_CHECK_THREAD
+    std::thread::id owner = std::this_thread::get_id();
+#endif
+};
+
+/// Base class for single-threaded reference counted objects with weak
+/// references
+/// @tparam T derived type for CRTP
+template <typename T> class refc_local_weak_base : public refc_local<T> {
+public:
+    struct weak_refc_policy {
+        static auto add_ref(const refc_local_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            x->check_thread();
+            auto r = x->weak_rc;
+            x->weak_rc += n;
+            return r;
+        }
+        static void release(const refc_local_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            x->check_thread();
+            if ((x->weak_rc -= n) == 0) {
+                detail::deallocate<T>(x);
+            }
+        }
+    };
+
+    struct strong_refc_policy {
+        static auto add_ref(const refc_local_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            x->check_thread();
+            auto r = x->rc;
+            x->weak_rc += n;
+            x->rc += n;
+            return r;
+        }
+        static auto try_ref(const refc_local_weak_base *x) noexcept
+        {
+            x->check_thread();
+            auto r = x->rc;
+            if (r > 0) {
+                x->weak_rc++;
+                x->rc++;
+            }
+            return r;
+        }
+        static void release(const refc_local_weak_base *x,
+                            unsigned long n = 1) noexcept
+        {
+            x->check_thread();
+            if ((x->rc -= n) == 0) {
+                std::destroy_at(x);
+            }
+            if ((x->weak_rc -= n) == 0) {
+                detail::deallocate<T>(x);
+            }
+        }
+    };
+    using policy_type = strong_refc_policy;
+    using weak_policy_type = weak_refc_policy;
+
+protected:
+    using refc_local<T>::refc_local;
+    mutable unsigned long weak_rc = 0;
+};
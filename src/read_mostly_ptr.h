@@ -0,0 +1,88 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "atomic_refc_ptr.h"
+
+/*
+ Holder for read-mostly snapshots (configs, routing tables) that readers
+ fetch far more often than writers replace them.
+
+ Each reader thread keeps a `reader` that caches its own refc_ptr together
+ with the version it was loaded at. The steady-state read is a single
+ acquire load of the version counter, no RMW touches the object's counter.
+ A store bumps the version and readers pick up the new snapshot on their
+ next get(). An old snapshot stays alive until every reader that cached it
+ has refreshed or was destroyed.
+
+ Usage:
+    read_mostly_ptr<config> cfg;
+    ...
+    thread_local read_mostly_ptr<config>::reader r(cfg);
+    const config &c = *r.get();
+*/
+template <typename T, typename Policy = typename T::policy_type>
+class read_mostly_ptr {
+public:
+    using value_type = refc_ptr<T, Policy>;
+
+    read_mostly_ptr() noexcept = default;
+    explicit read_mostly_ptr(value_type p) noexcept
+        : current(std::move(p))
+    {}
+    read_mostly_ptr(const read_mostly_ptr &) = delete;
+    read_mostly_ptr &operator=(const read_mostly_ptr &) = delete;
+
+    /// publish a new snapshot
+    void store(value_type p) noexcept
+    {
+        current.store(std::move(p));
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    /// owning reference to the current snapshot, bypasses reader caches
+    value_type load() const noexcept
+    {
+        return current.load();
+    }
+
+    /// per-thread cache, must not outlive the holder
+    class reader {
+    public:
+        explicit reader(const read_mostly_ptr &h) noexcept
+            : holder(&h)
+        {}
+
+        /// borrowed reference to the current snapshot, valid until the
+        /// next get() or reset() on this reader. Copy it to keep it longer.
+        const value_type &get() noexcept
+        {
+            auto v = holder->version.load(std::memory_order_acquire);
+            if (v != cached_version) {
+                cached = holder->current.load();
+                cached_version = v;
+            }
+            return cached;
+        }
+
+        const value_type &operator*() noexcept
+        {
+            return get();
+        }
+
+        /// drop the cached snapshot, the next get() reloads
+        void reset() noexcept
+        {
+            cached.reset();
+            cached_version = ~std::uint64_t(0);
+        }
+
+    private:
+        const read_mostly_ptr *holder;
+        value_type cached;
+        std::uint64_t cached_version = ~std::uint64_t(0);
+    };
+
+private:
+    atomic_refc_ptr<T, Policy> current;
+    // readers only load the version, keep it off the pointer's cache line
+    alignas(64) std::atomic<std::uint64_t> version{ 0 };
+};
@@ -0,0 +1,166 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <algorithm>
+#include <vector>
+
+/*
+ Vector of owning intrusive pointers with bulk reference counting.
+
+ Behaves like std::vector<refc_ptr<T>>, but copying, appending a range
+ and clearing group equal pointers and take or drop all their references
+ with one counted add_ref(p, n) / release(p, n) per distinct object, so
+ 10k copies of a handful of objects cost a handful of atomics.
+
+ Elements are stored as raw pointers, each holding one reference.
+*/
+
+template <typename T, typename Policy = typename T::policy_type>
+class refc_ptr_vector {
+public:
+    using value_type = refc_ptr<T, Policy>;
+    using size_type = std::size_t;
+    using const_iterator = T *const *;
+
+    refc_ptr_vector() noexcept = default;
+    refc_ptr_vector(const refc_ptr_vector &o)
+        : items(o.items)
+    {
+        add_refs(items);
+    }
+    refc_ptr_vector(refc_ptr_vector &&o) noexcept
+        : items(std::move(o.items))
+    {
+        o.items.clear();
+    }
+    template <typename It> refc_ptr_vector(It first, It last)
+    {
+        append(first, last);
+    }
+    refc_ptr_vector &operator=(const refc_ptr_vector &rhs)
+    {
+        refc_ptr_vector(rhs).swap(*this);
+        return *this;
+    }
+    refc_ptr_vector &operator=(refc_ptr_vector &&rhs) noexcept
+    {
+        refc_ptr_vector(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    ~refc_ptr_vector()
+    {
+        clear();
+    }
+
+    void swap(refc_ptr_vector &rhs) noexcept
+    {
+        items.swap(rhs.items);
+    }
+
+    size_type size() const noexcept
+    {
+        return items.size();
+    }
+    bool empty() const noexcept
+    {
+        return items.empty();
+    }
+    void reserve(size_type n)
+    {
+        items.reserve(n);
+    }
+
+    /// borrowed element, the vector keeps the reference
+    T *operator[](size_type i) const noexcept
+    {
+        return items[i];
+    }
+    /// owning copy of an element
+    value_type at(size_type i) const
+    {
+        return value_type(items.at(i));
+    }
+    const_iterator begin() const noexcept
+    {
+        return items.data();
+    }
+    const_iterator end() const noexcept
+    {
+        return items.data() + items.size();
+    }
+
+    void push_back(value_type p)
+    {
+        items.push_back(p.get());
+        p.detach();
+    }
+    value_type pop_back() noexcept
+    {
+        auto p = items.back();
+        items.pop_back();
+        return value_type(p, false);
+    }
+
+    /// append refc_ptrs or raw pointers from a range, one add_ref per
+    /// distinct object
+    template <typename It> void append(It first, It last)
+    {
+        std::vector<T *> incoming;
+        for (; first != last; ++first)
+            incoming.push_back(raw(*first));
+        // allocate first, nothing may throw once the references are taken
+        items.reserve(items.size() + incoming.size());
+        add_refs(incoming);
+        items.insert(items.end(), incoming.begin(), incoming.end());
+    }
+    void append(const refc_ptr_vector &o)
+    {
+        append(o.begin(), o.end());
+    }
+
+    /// drop all elements, one release per distinct object
+    void clear() noexcept
+    {
+        std::vector<T *> dying;
+        dying.swap(items);
+        // releases may run destructors that touch this vector
+        for_each_group(dying, [](T *p, unsigned long n) {
+            detail::release_refs<Policy>(p, n);
+        });
+    }
+
+private:
+    static T *raw(T *p) noexcept
+    {
+        return p;
+    }
+    template <typename U, typename P>
+    static T *raw(const refc_ptr<U, P> &p) noexcept
+    {
+        return p.get();
+    }
+
+    // one reference for each element of a copy of v
+    static void add_refs(std::vector<T *> v)
+    {
+        for_each_group(v, [](T *p, unsigned long n) {
+            detail::add_refs<Policy>(p, n);
+        });
+    }
+
+    // call f(p, count) once per distinct non-null pointer, reorders v
+    template <typename F>
+    static void for_each_group(std::vector<T *> &sorted, F f) noexcept
+    {
+        std::sort(sorted.begin(), sorted.end());
+        for (auto i = sorted.begin(); i != sorted.end();) {
+            auto j = std::find_if(i, sorted.end(),
+                                  [p = *i](T *q) { return q != p; });
+            if (*i)
+                f(*i, static_cast<unsigned long>(j - i));
+            i = j;
+        }
+    }
+
+    std::vector<T *> items;
+};
@@ -0,0 +1,132 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <array>
+
+/*
+ Sharded reference counting in the spirit of Linux percpu_ref.
+
+ While the object is live, add_ref/release go to one of Shards cache-line
+ sized counters picked by the calling thread, so threads hammering the same
+ object do not share a cache line. Shard counters may go negative, only
+ their sum is meaningful, and the object can not die in this mode: the
+ central counter holds a large bias playing the role of the initial
+ reference.
+
+ kill() switches to atomic mode: every shard is swapped for a `dead`
+ marker and its value folded into the central counter, then the bias is
+ dropped. An operation that finds its shard dead was not part of the sum
+ and goes to the central counter instead, so every operation is counted
+ exactly once and the last release is detected exactly.
+
+ An object that is never killed is never destroyed.
+*/
+
+namespace detail {
+inline unsigned sharded_slot() noexcept
+{
+    static std::atomic<unsigned> next{ 0 };
+    static thread_local unsigned slot =
+        next.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+} // namespace detail
+
+/// @brief base class for reference counted objects shared by many threads
+/// @tparam T derived class for CRTP
+/// @tparam Shards number of per-thread counter slots
+template <typename T, unsigned Shards = 16> class refc_sharded {
+    static constexpr long long bias = 1ll << 40;
+    // shard values at or above dead / 2 mark a dead shard
+    static constexpr long long dead = 1ll << 62;
+
+public:
+    struct refc_policy {
+        static void add_ref(const refc_sharded *p, unsigned long n = 1) noexcept
+        {
+            p->update(static_cast<long long>(n));
+        }
+        static void release(const refc_sharded *p, unsigned long n = 1) noexcept
+        {
+            if (p->update(-static_cast<long long>(n))) {
+                delete p;
+            }
+        }
+    };
+    using policy_type = refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+    /// switch to a single atomic counter, makes the object destroyable.
+    /// Call once, typically when the object is retired from its global slot.
+    void kill() const noexcept
+    {
+        if (killed.exchange(true, std::memory_order_relaxed))
+            return;
+        for (auto &s : shards) {
+            auto v = s.count.exchange(dead, std::memory_order_acq_rel);
+            central.fetch_add(v, std::memory_order_relaxed);
+        }
+        if (central.fetch_sub(bias, std::memory_order_acq_rel) == bias) {
+            delete this;
+        }
+    }
+
+    bool is_killed() const noexcept
+    {
+        return killed.load(std::memory_order_relaxed);
+    }
+
+    // refc_ref can't check liveness through refcount()
+    static constexpr bool approximate_refcount = true;
+
+    /// approximate while the object is live, exact once killed
+    unsigned long refcount() const noexcept
+    {
+        long long r = central.load(std::memory_order_relaxed);
+        for (auto &s : shards) {
+            auto v = s.count.load(std::memory_order_relaxed);
+            if (v < dead / 2)
+                r += v;
+        }
+        return static_cast<unsigned long>(is_killed() ? r : r - bias);
+    }
+    template <typename Y = T,
+              std::enable_if_t<std::is_base_of_v<refc_sharded, Y>, bool> = true>
+    refc_ptr<Y> shared_from_this()
+    {
+        return static_cast<Y *>(this);
+    }
+
+protected:
+    refc_sharded(const refc_sharded &) = delete;
+    refc_sharded &operator=(const refc_sharded &) = delete;
+
+    constexpr refc_sharded() = default;
+
+    virtual ~refc_sharded() = default;
+
+private:
+    /// @return true if the count dropped to zero
+    bool update(long long d) const noexcept
+    {
+        if (!killed.load(std::memory_order_relaxed)) {
+            auto &s = shards[detail::sharded_slot() % Shards];
+            // a dead shard absorbs the update without counting it
+            if (s.count.fetch_add(d, std::memory_order_release) < dead / 2)
+                return false;
+        }
+        if (d > 0) {
+            central.fetch_add(d, std::memory_order_relaxed);
+            return false;
+        }
+        return central.fetch_sub(-d, std::memory_order_acq_rel) == -d;
+    }
+
+    struct alignas(64) shard {
+        std::atomic<long long> count{ 0 };
+    };
+    mutable std::array<shard, Shards> shards;
+    alignas(64) mutable std::atomic<long long> central{ bias };
+    mutable std::atomic<bool> killed{ false };
+};
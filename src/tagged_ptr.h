@@ -0,0 +1,171 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "enum_util.h"
+#include "ptr.h"
+#include <cassert>
+#include <cstdint>
+
+/*
+ refc_ptr with a few flag bits packed into the pointer's low bits.
+
+ The flags are an `enum class` with ENABLE_BITMAP_OPERATORS and must fit
+ in the bits that alignof(T) keeps zero, checked at compile time against
+ Mask, by default the enum's `all` value:
+
+     enum class edge_flags : unsigned { dirty = 1, pinned = 2, shared = 4,
+                                        all = 7 };
+     ENABLE_BITMAP_OPERATORS(edge_flags)
+
+     tagged_refc_ptr<node, edge_flags> e(make_ptr<node>(), edge_flags::dirty);
+     if (e.test(edge_flags::dirty)) ...
+
+ Copy, move and reference counting are those of refc_ptr. The flags
+ travel with the pointer on copy and move, reset() and detach() clear
+ them, and comparison looks at both.
+*/
+
+template <typename T, typename FlagEnum, FlagEnum Mask = FlagEnum::all,
+          typename Policy = typename T::policy_type>
+class tagged_refc_ptr {
+    static_assert(is_bitmap<FlagEnum>::value,
+                  "flags must be an ENABLE_BITMAP_OPERATORS enum");
+    static constexpr std::uintptr_t mask = static_cast<std::uintptr_t>(Mask);
+    static_assert((mask & ~(std::uintptr_t(alignof(T)) - 1)) == 0,
+                  "alignof(T) leaves too few low bits for the flags");
+
+public:
+    using element_type = T;
+    using policy = Policy;
+    using flags_type = FlagEnum;
+
+    constexpr tagged_refc_ptr() noexcept = default;
+    explicit constexpr tagged_refc_ptr(std::nullptr_t) noexcept
+    {}
+    tagged_refc_ptr(T *p, FlagEnum f = FlagEnum(), bool ref = true) noexcept
+        : bits(pack(p, f))
+    {
+        if (p && ref)
+            policy::add_ref(p);
+    }
+    tagged_refc_ptr(refc_ptr<T, Policy> p, FlagEnum f = FlagEnum()) noexcept
+        : tagged_refc_ptr(p.detach(), f, false)
+    {}
+    tagged_refc_ptr(const tagged_refc_ptr &o) noexcept
+        : bits(o.bits)
+    {
+        if (auto p = get())
+            policy::add_ref(p);
+    }
+    tagged_refc_ptr(tagged_refc_ptr &&o) noexcept
+        : bits(o.bits)
+    {
+        o.bits = 0;
+    }
+    tagged_refc_ptr &operator=(const tagged_refc_ptr &rhs) noexcept
+    {
+        tagged_refc_ptr(rhs).swap(*this);
+        return *this;
+    }
+    tagged_refc_ptr &operator=(tagged_refc_ptr &&rhs) noexcept
+    {
+        tagged_refc_ptr(std::move(rhs)).swap(*this);
+        return *this;
+    }
+    ~tagged_refc_ptr()
+    {
+        if (auto p = get())
+            policy::release(p);
+    }
+
+    T *get() const noexcept
+    {
+        return reinterpret_cast<T *>(bits & ~mask);
+    }
+    T *operator->() const noexcept
+    {
+        return get();
+    }
+    T &operator*() const noexcept
+    {
+        return *get();
+    }
+    /// true if the pointer is set, whatever the flags
+    explicit operator bool() const noexcept
+    {
+        return get() != nullptr;
+    }
+
+    /// owning refc_ptr to the same object, without the flags
+    refc_ptr<T, Policy> ptr() const noexcept
+    {
+        return refc_ptr<T, Policy>(get());
+    }
+    operator refc_ptr<T, Policy>() const noexcept
+    {
+        return ptr();
+    }
+
+    FlagEnum flags() const noexcept
+    {
+        return static_cast<FlagEnum>(bits & mask);
+    }
+    void set_flags(FlagEnum f) noexcept
+    {
+        bits = pack(get(), f);
+    }
+    /// @return true if any of f is set
+    bool test(FlagEnum f) const noexcept
+    {
+        return isSet(flags() & f);
+    }
+    void set(FlagEnum f) noexcept
+    {
+        set_flags(flags() | f);
+    }
+    void clear(FlagEnum f) noexcept
+    {
+        set_flags(flags() & ~f);
+    }
+
+    void swap(tagged_refc_ptr &rhs) noexcept
+    {
+        std::swap(bits, rhs.bits);
+    }
+    void reset() noexcept
+    {
+        tagged_refc_ptr().swap(*this);
+    }
+    void reset(T *to, FlagEnum f = FlagEnum(), bool add_ref = true) noexcept
+    {
+        tagged_refc_ptr(to, f, add_ref).swap(*this);
+    }
+    /// give up the reference without releasing it, clears the flags
+    T *detach() noexcept
+    {
+        auto rv = get();
+        bits = 0;
+        return rv;
+    }
+
+    /// equal if both the object and the flags are
+    friend bool operator==(const tagged_refc_ptr &a,
+                           const tagged_refc_ptr &b) noexcept
+    {
+        return a.bits == b.bits;
+    }
+    friend bool operator!=(const tagged_refc_ptr &a,
+                           const tagged_refc_ptr &b) noexcept
+    {
+        return a.bits != b.bits;
+    }
+
+private:
+    static std::uintptr_t pack(T *p, FlagEnum f) noexcept
+    {
+        auto v = static_cast<std::uintptr_t>(f);
+        assert((v & ~mask) == 0 && "flag outside the mask");
+        return reinterpret_cast<std::uintptr_t>(p) | (v & mask);
+    }
+
+    std::uintptr_t bits = 0;
+};
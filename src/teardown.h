@@ -0,0 +1,222 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ Iterative (and optionally parallel) destruction of deep object graphs.
+
+ Releasing the head of a long refc_ptr chain normally recurses: the last
+ release deletes the object, whose member refc_ptr releases the next one,
+ and so on until the stack runs out. The last release of a refc_teardown
+ object instead pushes it on a thread-local worklist. The outermost
+ release on the thread drains the list, and every release of a child made
+ by a destructor on the way just adds to it, so the stack depth stays
+ constant for lists and trees of any depth.
+
+ parallel_teardown(ptr, threads) releases a pointer with helper threads:
+ while a helper is idle, a thread draining a worklist of a few objects
+ hands it the oldest half, the roots of the biggest pending subtrees.
+ Helpers without work sleep on a condition variable until a handoff or
+ the end of the teardown. A chain has at most one pending object and is
+ torn down on the calling thread regardless. Destructors must be safe to
+ run on any thread.
+*/
+
+namespace detail {
+
+class teardown {
+public:
+    using deleter = void (*)(const void *);
+
+    /// delete p with del now or, inside a teardown, after the current
+    /// object's destructor returns
+    static void retire(const void *p, deleter del) noexcept
+    {
+        auto &s = local();
+        try {
+            s.work.push_back({ p, del });
+        } catch (...) {
+            // out of memory for the list, fall back to recursion
+            del(p);
+            return;
+        }
+        if (!s.draining)
+            drain(s);
+    }
+
+    /// release through Policy with helper threads, see parallel_teardown
+    template <typename Policy, typename T>
+    static void run_parallel(T *root, unsigned threads) noexcept
+    {
+        auto &s = local();
+        // called from a destructor, the running teardown takes it
+        if (s.draining || s.shared) {
+            Policy::release(root);
+            return;
+        }
+        pool shared;
+        std::vector<std::thread> helpers;
+        for (unsigned i = 1; i < threads; i++) {
+            try {
+                helpers.emplace_back([&shared] { help(shared); });
+            } catch (...) {
+                break;
+            }
+        }
+        s.shared = &shared;
+        Policy::release(root);
+        shared.finish_batch();
+        help(shared);
+        for (auto &t : helpers)
+            t.join();
+    }
+
+private:
+    struct item {
+        const void *ptr;
+        deleter del;
+    };
+
+    // batches handed off for other threads; busy counts threads holding
+    // work that may still produce more, idle the helpers waiting for some
+    struct pool {
+        std::mutex lock;
+        std::condition_variable wake;
+        std::vector<std::vector<item>> batches;
+        unsigned busy = 1; // the releasing thread
+        std::atomic<unsigned> idle{ 0 };
+
+        void finish_batch() noexcept
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (--busy == 0)
+                wake.notify_all();
+        }
+    };
+
+    struct state {
+        std::vector<item> work;
+        pool *shared = nullptr;
+        bool draining = false;
+    };
+
+    // smallest worklist worth splitting
+    static constexpr std::size_t split_min = 4;
+
+    static state &local() noexcept
+    {
+        static thread_local state s;
+        return s;
+    }
+
+    static void drain(state &s) noexcept
+    {
+        s.draining = true;
+        while (!s.work.empty()) {
+            auto i = s.work.back();
+            s.work.pop_back();
+            i.del(i.ptr);
+            if (s.shared && s.work.size() >= split_min &&
+                s.shared->idle.load(std::memory_order_relaxed))
+                offload(s);
+        }
+        s.draining = false;
+    }
+
+    // hand the oldest half of the worklist, the roots of the largest
+    // pending subgraphs in depth-first order, to an idle helper
+    static void offload(state &s) noexcept
+    {
+        auto half = s.work.begin() + s.work.size() / 2;
+        try {
+            std::lock_guard<std::mutex> l(s.shared->lock);
+            // the previous handoff is not picked up yet
+            if (!s.shared->batches.empty())
+                return;
+            s.shared->batches.emplace_back(s.work.begin(), half);
+            s.shared->wake.notify_one();
+        } catch (...) {
+            return;
+        }
+        s.work.erase(s.work.begin(), half);
+    }
+
+    static void help(pool &shared) noexcept
+    {
+        auto &s = local();
+        s.shared = &shared;
+        std::unique_lock<std::mutex> l(shared.lock);
+        for (;;) {
+            if (!shared.batches.empty()) {
+                s.work.swap(shared.batches.back());
+                shared.batches.pop_back();
+                shared.busy++;
+                l.unlock();
+                drain(s);
+                shared.finish_batch();
+                l.lock();
+            } else if (shared.busy == 0) {
+                break;
+            } else {
+                shared.idle++;
+                // timed waits only, see background_reclaimer.h
+                while (!shared.wake.wait_for(
+                    l, std::chrono::milliseconds(100), [&] {
+                        return !shared.batches.empty() || shared.busy == 0;
+                    })) {
+                }
+                shared.idle--;
+            }
+        }
+        l.unlock();
+        s.shared = nullptr;
+    }
+};
+
+} // namespace detail
+
+/// @brief base class for reference counted objects that are destroyed
+/// iteratively, without recursion through member refc_ptrs
+/// @tparam T derived class for CRTP
+template <typename T> class refc_teardown : public refc<T> {
+public:
+    struct teardown_refc_policy {
+        static auto add_ref(const refc_teardown *p, unsigned long n = 1) noexcept
+        {
+            return refc<T>::immortal_refc_policy::add_ref(p, n);
+        }
+        static void release(const refc_teardown *p, unsigned long n = 1) noexcept
+        {
+            if (refc<T>::is_immortal(p->rc.load(std::memory_order_relaxed)))
+                return;
+            if (p->rc.fetch_sub(n, std::memory_order_release) == n) {
+                std::atomic_thread_fence(std::memory_order_acquire);
+                detail::teardown::retire(p, [](const void *x) {
+                    delete static_cast<const refc_teardown *>(x);
+                });
+            }
+        }
+    };
+    using policy_type = teardown_refc_policy;
+    using ptr = refc_ptr<T, policy_type>;
+    using cptr = refc_ptr<const T, policy_type>;
+
+protected:
+    using refc<T>::refc;
+};
+
+/// release p, spreading the destruction of what it kept alive over
+/// `threads` threads (the calling one included)
+template <typename T, typename Policy>
+void parallel_teardown(refc_ptr<T, Policy> p,
+                       unsigned threads = std::thread::hardware_concurrency())
+{
+    if (auto x = p.detach())
+        detail::teardown::run_parallel<Policy>(x, threads);
+}
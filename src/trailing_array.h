@@ -0,0 +1,169 @@
+#pragma once
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include "ptr.h"
+#include <cstddef>
+#include <new>
+
+/*
+ Reference counted objects with a trailing variable-length array.
+
+ The elements live right behind the object in the same allocation, so a
+ header plus its payload costs one allocation instead of two (object and
+ std::vector). Objects are created with make_trailing_ptr<T>(n, args...),
+ which passes the count on to T's constructor:
+
+     struct tokens : refc_trailing<tokens, int> {
+         tokens(trailing_count n, int first)
+             : refc_trailing(n)
+         {
+             (*this)[0] = first;
+         }
+     };
+     auto t = make_trailing_ptr<tokens>(10, 42);
+
+ Elements are value-initialized before T's constructor body runs and
+ destroyed after T's destructor. The objects are final in spirit: the
+ layout is computed from sizeof(T), so don't derive from T.
+*/
+
+/// element count handed from make_trailing_ptr to refc_trailing, along
+/// with the allocation operator new made for it
+struct trailing_count {
+    std::size_t n;
+    void *storage = nullptr;
+};
+
+/// @brief base class for reference counted objects followed by an array
+/// @tparam T derived class for CRTP
+/// @tparam E element type
+template <typename T, typename E> class refc_trailing : public refc<T> {
+public:
+    using element_type = E;
+    using iterator = E *;
+    using const_iterator = const E *;
+
+    std::size_t size() const noexcept
+    {
+        return count;
+    }
+    E *data() noexcept
+    {
+        return elements;
+    }
+    const E *data() const noexcept
+    {
+        return elements;
+    }
+    E &operator[](std::size_t i) noexcept
+    {
+        return data()[i];
+    }
+    const E &operator[](std::size_t i) const noexcept
+    {
+        return data()[i];
+    }
+    iterator begin() noexcept
+    {
+        return data();
+    }
+    iterator end() noexcept
+    {
+        return data() + count;
+    }
+    const_iterator begin() const noexcept
+    {
+        return data();
+    }
+    const_iterator end() const noexcept
+    {
+        return data() + count;
+    }
+
+    /// bytes in the allocation of an object with n elements
+    static constexpr std::size_t allocation_size(std::size_t n) noexcept
+    {
+        return elements_offset() + n * sizeof(E);
+    }
+
+    // only make_trailing_ptr knows how much to allocate
+    static void *operator new(std::size_t) = delete;
+    // records the allocation in c, which the constructor gets next
+    static void *operator new(std::size_t size, trailing_count &c)
+    {
+        assert(size == sizeof(T) && "classes derived from T can't be trailing");
+        (void)size;
+        auto bytes = allocation_size(c.n);
+        if constexpr (alignment() > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            c.storage = ::operator new(bytes, std::align_val_t(alignment()));
+        else
+            c.storage = ::operator new(bytes);
+        return c.storage;
+    }
+    static void operator delete(void *p) noexcept
+    {
+        if constexpr (alignment() > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            ::operator delete(p, std::align_val_t(alignment()));
+        else
+            ::operator delete(p);
+    }
+    // called if T's constructor throws
+    static void operator delete(void *p, trailing_count &) noexcept
+    {
+        operator delete(p);
+    }
+
+protected:
+    // the elements are found from the allocation rather than from a T
+    // that is not constructed yet
+    explicit refc_trailing(trailing_count c)
+        : elements(reinterpret_cast<E *>(static_cast<char *>(c.storage) +
+                                         elements_offset()))
+        , count(0)
+    {
+        assert(c.storage && "create with make_trailing_ptr");
+        try {
+            for (; count < c.n; count++)
+                new (elements + count) E();
+        } catch (...) {
+            destroy();
+            throw;
+        }
+    }
+
+    ~refc_trailing()
+    {
+        destroy();
+    }
+
+private:
+    static constexpr std::size_t alignment() noexcept
+    {
+        return alignof(T) > alignof(E) ? alignof(T) : alignof(E);
+    }
+
+    static constexpr std::size_t elements_offset() noexcept
+    {
+        return (sizeof(T) + alignof(E) - 1) / alignof(E) * alignof(E);
+    }
+
+    void destroy() noexcept
+    {
+        while (count > 0)
+            elements[--count].~E();
+    }
+
+    E *const elements;
+    std::size_t count;
+};
+
+/// create T with n trailing elements in a single allocation, T's
+/// constructor receives trailing_count{n} followed by args
+template <typename T, typename... Args>
+typename T::ptr make_trailing_ptr(std::size_t n, Args &&... args)
+{
+    using base = refc_trailing<T, typename T::element_type>;
+    static_assert(std::is_base_of_v<base, T>,
+                  "make_trailing_ptr needs a refc_trailing<T, E> type");
+    trailing_count c{ n };
+    return typename T::ptr(new (c) T(c, std::forward<Args>(args)...));
+}
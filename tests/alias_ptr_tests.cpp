@@ -0,0 +1,91 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <alias_ptr.h>
+#include <gtest/gtest.h>
+#include <vector>
+
+namespace {
+struct buffer : public refc<buffer> {
+    static int instance_count;
+    std::vector<int> data = { 1, 2, 3, 4 };
+    int header = 5;
+    buffer()
+    {
+        instance_count++;
+    }
+    ~buffer()
+    {
+        instance_count--;
+    }
+};
+int buffer::instance_count = 0;
+
+struct derived_buffer : public buffer {};
+
+struct weak_buffer : public refc_weak_base<weak_buffer> {
+    int values[3] = { 7, 8, 9 };
+};
+} // namespace
+
+TEST(refc_alias_ptr, interior_pointer)
+{
+    refc_alias_ptr<int, buffer> elem;
+    EXPECT_FALSE(elem);
+    {
+        buffer::ptr b(new buffer);
+        elem = make_alias(b, &b->data[2]);
+        EXPECT_EQ(b->refcount(), 2);
+        EXPECT_EQ(*elem, 3);
+        auto copy = elem;
+        EXPECT_EQ(b->refcount(), 3);
+        EXPECT_EQ(copy, elem);
+        // another member of the same owner
+        refc_alias_ptr<int, buffer> header(copy, &b->header);
+        EXPECT_EQ(*header, 5);
+        EXPECT_EQ(b->refcount(), 4);
+        EXPECT_NE(header, elem);
+    }
+    EXPECT_EQ(buffer::instance_count, 1);
+    EXPECT_EQ(elem.owner()->data.size(), 4u);
+    elem.reset();
+    EXPECT_EQ(buffer::instance_count, 0);
+}
+
+TEST(refc_alias_ptr, conversions)
+{
+    buffer::ptr b(new buffer);
+    // refc_ptr -> alias of the owner itself, one add_ref
+    refc_alias_ptr<buffer, buffer> self = b;
+    EXPECT_EQ(self.get(), b.get());
+    EXPECT_EQ(b->refcount(), 2);
+    refc_alias_ptr<const int, buffer> c = make_alias(b, &b->header);
+    refc_alias_ptr<const int, buffer> cc = c;
+    EXPECT_EQ(*cc, 5);
+    EXPECT_EQ(b->refcount(), 4);
+    // moves don't touch the count
+    refc_alias_ptr<const int, buffer> moved(std::move(cc));
+    EXPECT_FALSE(cc);
+    EXPECT_EQ(b->refcount(), 4);
+    // alias -> refc_ptr of the owner
+    buffer::ptr back = moved.release_owner();
+    EXPECT_FALSE(moved);
+    EXPECT_EQ(back, b);
+    EXPECT_EQ(b->refcount(), 4);
+
+    refc_ptr<derived_buffer> d(new derived_buffer);
+    refc_alias_ptr<buffer, buffer> base = std::move(d);
+    EXPECT_FALSE(d);
+    EXPECT_EQ(base->refcount(), 1);
+}
+
+TEST(refc_alias_ptr, weak_owner)
+{
+    refc_ptr<weak_buffer> w(new weak_buffer);
+    refc_weak_ptr<weak_buffer> ww;
+    ww = w;
+    auto v = make_alias(w, &w->values[1]);
+    w.reset();
+    EXPECT_EQ(*v, 8);
+    EXPECT_TRUE(ww.lock());
+    v.reset();
+    EXPECT_FALSE(ww.lock());
+}
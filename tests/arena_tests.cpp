@@ -0,0 +1,137 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <arena.h>
+#include <gtest/gtest.h>
+#include <make_ptr.h>
+#include <string>
+
+namespace {
+struct node : public refc_arena<node> {
+    static int instance_count;
+    int value;
+    ptr next;
+    std::string name = "a name long enough to allocate on the heap";
+    node(int v, ptr n = {})
+        : value(v)
+        , next(std::move(n))
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        instance_count--;
+    }
+};
+int node::instance_count = 0;
+
+struct pod : public refc_arena<pod> {
+    int value = 0;
+};
+
+struct throws : public refc_arena<throws> {
+    static int instance_count;
+    node::ptr child;
+    std::string s;
+    throws(bool fail)
+        : child(make_ptr<node>(0))
+    {
+        if (fail)
+            throw std::runtime_error("ctor");
+        instance_count++;
+    }
+    ~throws()
+    {
+        instance_count--;
+    }
+};
+int throws::instance_count = 0;
+} // namespace
+
+TEST(refc_arena, bump_allocation)
+{
+    object_arena arena;
+    object_arena_scope scope(arena);
+    auto a = make_ptr<pod>();
+    auto b = make_ptr<pod>();
+    auto distance = reinterpret_cast<char *>(b.get()) -
+                    reinterpret_cast<char *>(a.get());
+    EXPECT_GT(distance, 0);
+    EXPECT_LE(distance, 32);
+}
+
+TEST(refc_arena, reset_destroys_everything)
+{
+    object_arena arena;
+    {
+        object_arena_scope scope(arena);
+        node::ptr head;
+        for (int i = 0; i < 100000; i++)
+            head = make_ptr<node>(i, std::move(head));
+        EXPECT_EQ(node::instance_count, 100000);
+        EXPECT_EQ(head->value, 99999);
+        // releasing the head frees nothing, and does not recurse
+        head.reset();
+        EXPECT_EQ(node::instance_count, 100000);
+    }
+    arena.reset();
+    EXPECT_EQ(node::instance_count, 0);
+
+    // the arena is reusable after reset
+    object_arena_scope scope(arena);
+    auto p = make_ptr<node>(1);
+    EXPECT_EQ(node::instance_count, 1);
+    p.reset();
+    arena.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(refc_arena, nested_scopes)
+{
+    object_arena outer, inner;
+    object_arena_scope s1(outer);
+    {
+        object_arena_scope s2(inner);
+        EXPECT_EQ(object_arena::current(), &inner);
+        make_ptr<node>(1);
+    }
+    EXPECT_EQ(object_arena::current(), &outer);
+    inner.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(refc_arena, constructor_throws)
+{
+    object_arena arena;
+    {
+        object_arena_scope scope(arena);
+        EXPECT_THROW(make_ptr<throws>(true), std::runtime_error);
+        auto ok = make_ptr<throws>(false);
+        EXPECT_EQ(throws::instance_count, 1);
+    }
+    arena.reset();
+    EXPECT_EQ(throws::instance_count, 0);
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+#if REFC_ARENA_CHECK
+TEST(refc_arena_death, pointer_outlives_reset)
+{
+    EXPECT_DEATH(
+        {
+            object_arena arena;
+            node::ptr p;
+            {
+                object_arena_scope scope(arena);
+                p = make_ptr<node>(1);
+            }
+            arena.reset();
+        },
+        "outlives reset");
+}
+#endif
+
+TEST(refc_arena_death, created_outside_scope)
+{
+    // no operator new involved, the constructor has to catch it
+    EXPECT_DEATH({ node n(1); }, "");
+    EXPECT_DEATH({ pod p; }, "");
+}
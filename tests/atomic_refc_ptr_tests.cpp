@@ -0,0 +1,135 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <atomic_refc_ptr.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+template <typename b> struct node_t : public b {
+    static std::atomic<int> instance_count;
+    int value;
+    node_t(int v = 0)
+        : value(v)
+    {
+        instance_count++;
+    }
+    ~node_t()
+    {
+        instance_count--;
+    }
+};
+template <typename b> std::atomic<int> node_t<b>::instance_count = 0;
+
+struct strong_only : public refc<strong_only> {};
+struct weak_capable : public refc_weak_base<weak_capable> {};
+} // namespace
+
+template <typename b> class atomic_refc_ptr_test : public testing::Test {
+protected:
+    using node = node_t<b>;
+};
+
+using NodeBases = testing::Types<strong_only, weak_capable>;
+TYPED_TEST_SUITE(atomic_refc_ptr_test, NodeBases);
+
+TYPED_TEST(atomic_refc_ptr_test, load_store)
+{
+    using node = typename TestFixture::node;
+    {
+        atomic_refc_ptr<node> a;
+        EXPECT_TRUE(a.is_lock_free());
+        EXPECT_FALSE(a.load());
+        refc_ptr<node> n(new node(1));
+        a.store(n);
+        EXPECT_EQ(n->refcount(), 2);
+        auto l = a.load();
+        EXPECT_EQ(l, n);
+        EXPECT_EQ(n->refcount(), 3);
+        a = refc_ptr<node>(new node(2));
+        EXPECT_EQ(n->refcount(), 2);
+        EXPECT_EQ(a.load()->value, 2);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TYPED_TEST(atomic_refc_ptr_test, exchange)
+{
+    using node = typename TestFixture::node;
+    {
+        atomic_refc_ptr<node> a(refc_ptr<node>(new node(1)));
+        auto old = a.exchange(refc_ptr<node>(new node(2)));
+        EXPECT_EQ(old->value, 1);
+        EXPECT_EQ(old->refcount(), 1);
+        old = a.exchange(refc_ptr<node>());
+        EXPECT_EQ(old->value, 2);
+        EXPECT_FALSE(a.load());
+        EXPECT_EQ(node::instance_count, 1);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TYPED_TEST(atomic_refc_ptr_test, compare_exchange)
+{
+    using node = typename TestFixture::node;
+    {
+        refc_ptr<node> n1(new node(1));
+        atomic_refc_ptr<node> a(n1);
+        refc_ptr<node> expected;
+        EXPECT_FALSE(a.compare_exchange_strong(expected,
+                                               refc_ptr<node>(new node(2))));
+        EXPECT_EQ(expected, n1);
+        EXPECT_EQ(n1->refcount(), 3);
+        EXPECT_TRUE(a.compare_exchange_strong(expected,
+                                              refc_ptr<node>(new node(3))));
+        EXPECT_EQ(n1->refcount(), 2);
+        EXPECT_EQ(a.load()->value, 3);
+        EXPECT_EQ(node::instance_count, 2);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TYPED_TEST(atomic_refc_ptr_test, readers_and_writers)
+{
+    using node = typename TestFixture::node;
+    constexpr int READERS = 4;
+    constexpr int WRITES = 5000;
+    {
+        atomic_refc_ptr<node> a(refc_ptr<node>(new node(0)));
+        std::atomic<bool> done{ false };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < READERS; i++) {
+            threads.emplace_back([&] {
+                int last = 0;
+                while (!done) {
+                    auto p = a.load();
+                    ASSERT_TRUE(p);
+                    // writers only ever increase the value
+                    EXPECT_GE(p->value, last);
+                    last = p->value;
+                }
+            });
+        }
+        std::thread cas_writer([&] {
+            for (int i = 0; i < WRITES; i++) {
+                auto cur = a.load();
+                while (!a.compare_exchange_weak(
+                    cur, refc_ptr<node>(new node(cur->value + 1)))) {
+                }
+            }
+        });
+        for (int i = 0; i < WRITES; i++) {
+            auto cur = a.load();
+            while (!a.compare_exchange_weak(
+                cur, refc_ptr<node>(new node(cur->value + 1)))) {
+            }
+        }
+        cas_writer.join();
+        done = true;
+        for (auto &t : threads)
+            t.join();
+        EXPECT_EQ(a.load()->value, 2 * WRITES);
+        EXPECT_EQ(a.load()->refcount(), 2);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
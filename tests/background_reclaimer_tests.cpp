@@ -0,0 +1,82 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <background_reclaimer.h>
+#include <gtest/gtest.h>
+#include <thread>
+
+namespace {
+struct big : public refc_background<big> {
+    static std::atomic<int> instance_count;
+    static std::thread::id destroyed_on;
+    ptr child;
+    big(ptr c = {})
+        : child(std::move(c))
+    {
+        instance_count++;
+    }
+    ~big()
+    {
+        destroyed_on = std::this_thread::get_id();
+        instance_count--;
+    }
+};
+std::atomic<int> big::instance_count = 0;
+std::thread::id big::destroyed_on;
+} // namespace
+
+TEST(background_reclaimer, destroyed_off_thread)
+{
+    auto &r = background_reclaimer::instance();
+    auto before = r.get_stats();
+    big::ptr(new big(big::ptr(new big)));
+    r.drain();
+    EXPECT_EQ(big::instance_count, 0);
+    EXPECT_NE(big::destroyed_on, std::this_thread::get_id());
+    auto after = r.get_stats();
+    EXPECT_EQ(after.queue_depth, 0);
+    EXPECT_EQ(after.reclaimed - before.reclaimed, 2);
+    EXPECT_GE(after.total_latency, after.max_latency);
+}
+
+TEST(background_reclaimer, shutdown)
+{
+    background_reclaimer r;
+    std::atomic<int> deleted{ 0 };
+    static std::atomic<int> *counter;
+    counter = &deleted;
+    auto del = [](const void *) { (*counter)++; };
+    for (int i = 0; i < 10; i++)
+        r.enqueue(nullptr, del);
+    r.shutdown();
+    EXPECT_EQ(deleted, 10);
+    EXPECT_EQ(r.get_stats().reclaimed, 10);
+    // inline after shutdown
+    r.enqueue(nullptr, del);
+    EXPECT_EQ(deleted, 11);
+    EXPECT_EQ(r.get_stats().reclaimed, 10);
+}
+
+TEST(background_reclaimer, called_from_reclaimer_thread)
+{
+    background_reclaimer r;
+    static background_reclaimer *self;
+    static std::atomic<int> deleted;
+    self = &r;
+    deleted = 0;
+    auto del = [](const void *) { deleted++; };
+    // a destructor that drains, and one that shuts down, on the worker
+    r.enqueue(nullptr, [](const void *) {
+        self->enqueue(nullptr, [](const void *) { deleted++; });
+        self->drain();
+        EXPECT_EQ(deleted, 1);
+    });
+    r.drain();
+    EXPECT_EQ(deleted, 1);
+    r.enqueue(nullptr, [](const void *) { self->shutdown(); });
+    r.drain();
+    // stopped from its own thread, deletes inline now
+    r.enqueue(nullptr, del);
+    EXPECT_EQ(deleted, 2);
+    r.shutdown();
+    EXPECT_EQ(r.get_stats().reclaimed, 3);
+}
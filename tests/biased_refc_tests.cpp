@@ -0,0 +1,191 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <biased_refc.h>
+#include <gtest/gtest.h>
+#include <pool.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct biased : public refc_biased<biased> {
+    static std::atomic<int> instance_count;
+    int value = 100500;
+    std::vector<int> values = { 1, 2, 3 };
+    biased()
+    {
+        instance_count++;
+    }
+    ~biased()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> biased::instance_count = 0;
+
+struct alignas(64) wide_biased : public refc_biased<wide_biased> {
+    char bytes[64];
+};
+
+struct pooled_biased : public refc_biased<pooled_biased>,
+                       public pool_allocated {
+    int value = 1;
+};
+
+int read(refc_ref<biased> r)
+{
+    return r->value;
+}
+} // namespace
+
+TEST(refc_biased, owner_thread)
+{
+    {
+        biased::ptr p(new biased);
+        EXPECT_EQ(p->refcount(), 1);
+        auto p2 = p;
+        EXPECT_EQ(p->refcount(), 2);
+        refc_weak_ptr<biased> w(p);
+        EXPECT_EQ(w.lock(), p);
+    }
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, shared_refs)
+{
+    biased::ptr p(new biased);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([p] {
+            for (int j = 0; j < 1000; j++) {
+                auto p2 = p;
+                EXPECT_EQ(p2->value, 100500);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(p->refcount(), 1);
+    p.reset();
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, released_by_other_thread)
+{
+    biased::ptr p(new biased);
+    refc_weak_ptr<biased> w(p);
+    std::thread([p = std::move(p)]() mutable { p.reset(); }).join();
+    // queued with the owner until it merges
+    EXPECT_EQ(biased::instance_count, 1);
+    refc_biased_drain();
+    EXPECT_EQ(biased::instance_count, 0);
+    EXPECT_FALSE(w.lock());
+}
+
+TEST(refc_biased, refcount_on_other_thread)
+{
+    biased::ptr p(new biased);
+    auto q = p;
+    std::thread([raw = p.get(), q = std::move(q)]() mutable {
+        q.reset();
+        // the release went to the shared count, the biased refs are unseen
+        EXPECT_EQ(raw->refcount(), 0u);
+    }).join();
+    EXPECT_EQ(p->refcount(), 1u);
+}
+
+TEST(refc_biased, borrowed_on_other_thread)
+{
+    biased::ptr p(new biased);
+    // the owner's biased count is invisible here, refc_ref must not check it
+    std::thread([&p] { EXPECT_EQ(read(p), 100500); }).join();
+    EXPECT_EQ(read(p), 100500);
+}
+
+TEST(refc_biased, drained_on_owner_release)
+{
+    biased::ptr p(new biased);
+    std::thread([p = std::move(p)]() mutable { p.reset(); }).join();
+    EXPECT_EQ(biased::instance_count, 1);
+    biased::ptr(new biased).reset();
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, first_ref_on_other_thread)
+{
+    auto raw = new biased;
+    std::thread([raw] { biased::ptr p(raw); }).join();
+    refc_biased_drain();
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, owner_exited)
+{
+    biased::ptr p;
+    std::thread([&p] { p = biased::ptr(new biased); }).join();
+    EXPECT_EQ(p->value, 100500);
+    auto p2 = p;
+    p.reset();
+    EXPECT_EQ(biased::instance_count, 1);
+    p2.reset();
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, try_ref_race)
+{
+    constexpr int ITERATIONS = 10000;
+    constexpr int THREAD_COUNT = 4;
+
+    std::vector<std::thread> threads;
+
+    std::vector<biased::ptr> ptrs(ITERATIONS);
+    std::vector<refc_weak_ptr<biased>> weak_ptrs(ITERATIONS);
+    for (int i = 0; i < ITERATIONS; i++) {
+        ptrs[i] = biased::ptr(new biased);
+        weak_ptrs[i] = ptrs[i];
+    }
+    std::atomic<bool> done(false);
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < ITERATIONS && !done; j++) {
+                auto ptr = weak_ptrs[j].lock();
+                if (ptr) {
+                    EXPECT_EQ(ptr->value, 100500);
+                    EXPECT_EQ(ptr->values.size(), 3);
+                    EXPECT_EQ(ptr->values[2], 3);
+                }
+            }
+        }));
+    }
+    for (auto &p : ptrs) {
+        p.reset();
+        std::this_thread::sleep_for(std::chrono::microseconds(1));
+    }
+    done = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    refc_biased_drain();
+    EXPECT_EQ(biased::instance_count, 0);
+}
+
+TEST(refc_biased, frees_like_delete)
+{
+    // over-aligned storage goes back with its alignment
+    refc_weak_ptr<wide_biased> w;
+    {
+        wide_biased::ptr p(new wide_biased);
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(p.get()) % 64, 0u);
+        w = p;
+    }
+    EXPECT_FALSE(w.lock());
+    w = refc_weak_ptr<wide_biased>();
+
+    // and through the class operator delete
+    void *addr;
+    {
+        pooled_biased::ptr p(new pooled_biased);
+        addr = p.get();
+    }
+    pooled_biased::ptr q(new pooled_biased);
+    EXPECT_EQ(q.get(), addr);
+}
@@ -0,0 +1,192 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <compressed_ptr.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct test_heap {
+    static refc_region<3> &get()
+    {
+        static auto *r = new refc_region<3>(std::size_t(16) << 20);
+        return *r;
+    }
+};
+struct wide_heap {
+    static refc_region<4> &get()
+    {
+        static auto *r = new refc_region<4>(std::size_t(1) << 20);
+        return *r;
+    }
+};
+
+struct node : public refc<node>, public region_allocated<test_heap> {
+    static std::atomic<int> instance_count;
+    int value;
+    compressed_refc_ptr<node> next;
+    explicit node(int v = 0)
+        : value(v)
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> node::instance_count = 0;
+
+struct weak_node : public refc_weak_base<weak_node>,
+                   public region_allocated<test_heap> {
+    int value = 42;
+};
+
+struct alignas(16) wide : public refc<wide>, public region_allocated<wide_heap> {
+    double v[2] = { 1, 2 };
+};
+} // namespace
+
+TEST(compressed_refc_ptr, basic)
+{
+    static_assert(sizeof(compressed_refc_ptr<node>) == 4);
+    {
+        compressed_refc_ptr<node> p(new node(1));
+        EXPECT_TRUE(p);
+        EXPECT_EQ(p->value, 1);
+        EXPECT_EQ(p->refcount(), 1);
+        auto q = p;
+        EXPECT_EQ(p->refcount(), 2);
+        EXPECT_EQ(p, q);
+        q.reset();
+        EXPECT_FALSE(q);
+        EXPECT_EQ(p->refcount(), 1);
+        q = std::move(p);
+        EXPECT_FALSE(p);
+        EXPECT_EQ(q->refcount(), 1);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(compressed_refc_ptr, interop_with_refc_ptr)
+{
+    node::ptr p(new node(2));
+    compressed_refc_ptr<node> c = p;
+    EXPECT_EQ(c.get(), p.get());
+    EXPECT_EQ(p->refcount(), 2);
+    node::ptr back = c;
+    EXPECT_EQ(back, p);
+    EXPECT_EQ(p->refcount(), 3);
+    compressed_refc_ptr<node> adopted(std::move(back));
+    EXPECT_EQ(p->refcount(), 3);
+    c.reset();
+    adopted.reset();
+    EXPECT_EQ(p->refcount(), 1);
+}
+
+TEST(compressed_refc_ptr, list)
+{
+    constexpr int COUNT = 10000;
+    {
+        compressed_refc_ptr<node> head;
+        for (int i = 0; i < COUNT; i++) {
+            compressed_refc_ptr<node> n(new node(i));
+            n->next = std::move(head);
+            head = std::move(n);
+        }
+        EXPECT_EQ(node::instance_count, COUNT);
+        int expected = COUNT;
+        for (auto p = head.get(); p; p = p->next.get())
+            EXPECT_EQ(p->value, --expected);
+        // unlink iteratively, the recursive destructor would be deep
+        while (head) {
+            auto next = std::move(head->next);
+            head = std::move(next);
+        }
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(compressed_refc_ptr, memory_reused)
+{
+    auto &r = test_heap::get();
+    node::ptr(new node);
+    auto pages = r.pages_used();
+    for (int i = 0; i < 100000; i++)
+        compressed_refc_ptr<node> p(new node(i));
+    EXPECT_EQ(r.pages_used(), pages);
+}
+
+TEST(compressed_refc_ptr, sixteen_byte_units)
+{
+    static_assert(refc_region<4>::alignment == 16);
+    compressed_refc_ptr<wide> p(new wide);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(p.get()) % 16, 0u);
+    EXPECT_EQ(p->v[1], 2);
+    EXPECT_TRUE(wide_heap::get().contains(p.get()));
+    EXPECT_FALSE(test_heap::get().contains(p.get()));
+}
+
+TEST(compressed_refc_ptr, region_exhausted)
+{
+    refc_region<3> r(refc_region<3>::page_size);
+    EXPECT_NE(r.allocate(100), nullptr);
+    EXPECT_THROW(r.allocate(200), std::bad_alloc);
+    EXPECT_THROW(r.allocate(refc_region<3>::page_size + 1), std::bad_alloc);
+}
+
+TEST(compressed_refc_ptr, page_in_address_order)
+{
+    refc_region<3> r(refc_region<3>::page_size);
+    auto a = static_cast<char *>(r.allocate(24));
+    auto b = static_cast<char *>(r.allocate(24));
+    EXPECT_EQ(r.offset_of(a), 1u);
+    EXPECT_EQ(b, a + 24);
+    // the last unit of a full region still gets a nonzero handle
+    static_assert((refc_region<3>::max_capacity >> 3) <= 0xffffffff);
+    static_assert((refc_region<4>::max_capacity >> 4) <= 0xffffffff);
+}
+
+TEST(compressed_refc_weak_ptr, lock)
+{
+    static_assert(sizeof(compressed_refc_weak_ptr<weak_node>) == 4);
+    compressed_refc_weak_ptr<weak_node> w;
+    EXPECT_FALSE(w.lock());
+    {
+        refc_ptr<weak_node> p(new weak_node);
+        compressed_refc_ptr<weak_node> c = p;
+        w = c;
+        auto w2 = w;
+        EXPECT_EQ(w2.lock(), p);
+        EXPECT_EQ(w.lock()->value, 42);
+    }
+    EXPECT_FALSE(w.lock());
+}
+
+TEST(compressed_refc_weak_ptr, try_ref_race)
+{
+    constexpr int ITERATIONS = 10000;
+    constexpr int THREAD_COUNT = 4;
+
+    std::vector<std::thread> threads;
+    std::vector<compressed_refc_ptr<weak_node>> ptrs(ITERATIONS);
+    std::vector<compressed_refc_weak_ptr<weak_node>> weak_ptrs(ITERATIONS);
+    for (int i = 0; i < ITERATIONS; i++) {
+        ptrs[i] = compressed_refc_ptr<weak_node>(new weak_node);
+        weak_ptrs[i] = ptrs[i];
+    }
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < ITERATIONS; j++) {
+                if (auto p = weak_ptrs[j].lock()) {
+                    EXPECT_EQ(p->value, 42);
+                }
+            }
+        }));
+    }
+    for (auto &p : ptrs)
+        p.reset();
+    for (auto &t : threads)
+        t.join();
+    weak_ptrs.clear();
+}
@@ -0,0 +1,135 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <chrono>
+#include <ctl_weak.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct big : public refc_ctl_weak_base<big> {
+    static std::atomic<int> instance_count;
+    static std::atomic<int> freed;
+    int value = 100500;
+    std::vector<int> values = { 1, 2, 3 };
+    char payload[4096];
+    big()
+    {
+        instance_count++;
+    }
+    ~big()
+    {
+        instance_count--;
+    }
+    static void *operator new(std::size_t size)
+    {
+        return ::operator new(size);
+    }
+    static void operator delete(void *p) noexcept
+    {
+        freed++;
+        ::operator delete(p);
+    }
+};
+std::atomic<int> big::instance_count = 0;
+std::atomic<int> big::freed = 0;
+
+struct derived : public big {
+    int extra = 1;
+};
+
+struct throws : public refc_ctl_weak_base<throws> {
+    throws()
+    {
+        throw std::runtime_error("ctor");
+    }
+};
+} // namespace
+
+TEST(refc_ctl_weak_base, weak_ptr_basic)
+{
+    big::weak_ptr w;
+    EXPECT_TRUE(w.expired());
+    EXPECT_FALSE(w.lock());
+    {
+        big::ptr p(new big);
+        w = p;
+        EXPECT_EQ(w.lock(), p);
+        EXPECT_EQ(p->refcount(), 1);
+        auto w2 = w;
+        auto p2 = w2.lock();
+        EXPECT_EQ(p->refcount(), 2);
+    }
+    EXPECT_EQ(big::instance_count, 0);
+    EXPECT_TRUE(w.expired());
+    EXPECT_FALSE(w.lock());
+}
+
+TEST(refc_ctl_weak_base, memory_freed_with_last_strong)
+{
+    auto freed = big::freed.load();
+    big::ptr p(new big);
+    big::weak_ptr w = p;
+    p.reset();
+    // the payload is gone although a weak pointer is left
+    EXPECT_EQ(big::freed, freed + 1);
+    EXPECT_FALSE(w.lock());
+    w.reset();
+    EXPECT_EQ(big::freed, freed + 1);
+}
+
+TEST(refc_ctl_weak_base, conversions)
+{
+    refc_ptr<derived> d(new derived);
+    refc_ctl_weak_ptr<derived> wd = d;
+    refc_ctl_weak_ptr<big> wb = wd;
+    EXPECT_EQ(wb.lock().get(), d.get());
+    EXPECT_EQ(wd.lock()->extra, 1);
+    auto self = d->shared_from_this<derived>();
+    EXPECT_EQ(self, d);
+    self.reset();
+    d.reset();
+    EXPECT_FALSE(wb.lock());
+    EXPECT_EQ(big::instance_count, 0);
+}
+
+TEST(refc_ctl_weak_base, constructor_throws)
+{
+    // the control block goes with the half-built object
+    EXPECT_THROW(throws::ptr(new throws), std::runtime_error);
+}
+
+TEST(refc_ctl_weak_base, try_ref_race)
+{
+    constexpr int ITERATIONS = 10000;
+    constexpr int THREAD_COUNT = 4;
+
+    std::vector<std::thread> threads;
+    std::vector<big::ptr> ptrs(ITERATIONS);
+    std::vector<big::weak_ptr> weak_ptrs(ITERATIONS);
+    for (int i = 0; i < ITERATIONS; i++) {
+        ptrs[i] = big::ptr(new big);
+        weak_ptrs[i] = ptrs[i];
+    }
+    std::atomic<bool> done(false);
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < ITERATIONS && !done; j++) {
+                auto ptr = weak_ptrs[j].lock();
+                if (ptr) {
+                    EXPECT_EQ(ptr->value, 100500);
+                    EXPECT_EQ(ptr->values[2], 3);
+                }
+            }
+        }));
+    }
+    for (auto &p : ptrs) {
+        p.reset();
+        std::this_thread::sleep_for(std::chrono::microseconds(1));
+    }
+    done = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(big::instance_count, 0);
+}
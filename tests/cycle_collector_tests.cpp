@@ -0,0 +1,229 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <cycle_collector.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct node : public refc_collectable<node> {
+    static std::atomic<int> instance_count;
+    ptr parent;
+    std::vector<ptr> children;
+    node()
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        // members are already cut when collected as garbage
+        EXPECT_FALSE(parent);
+        instance_count--;
+    }
+    void traverse(cycle_visitor &visit) override
+    {
+        visit(parent);
+        for (auto &c : children)
+            visit(c);
+    }
+    static ptr make_child(const ptr &p)
+    {
+        ptr c(new node);
+        p->children.push_back(c);
+        c->parent = p;
+        return c;
+    }
+};
+std::atomic<int> node::instance_count = 0;
+
+// holds an unreported pointer
+struct opaque : public refc_collectable<opaque> {
+    ptr other;
+};
+
+auto &collector()
+{
+    return cycle_collector::instance();
+}
+
+// empty the root buffers left by earlier tests
+void reset_collector()
+{
+    collector().collect();
+}
+} // namespace
+
+TEST(cycle_collector, parent_child_cycle)
+{
+    reset_collector();
+    {
+        node::ptr root(new node);
+        for (int i = 0; i < 10; i++)
+            node::make_child(root);
+    }
+    // leaked by plain reference counting
+    EXPECT_EQ(node::instance_count, 11);
+    EXPECT_GT(collector().get_stats().roots, 0u);
+    EXPECT_EQ(collector().collect_step(), 11u);
+    EXPECT_EQ(node::instance_count, 0);
+    EXPECT_EQ(collector().get_stats().roots, 0u);
+}
+
+TEST(cycle_collector, live_objects_kept)
+{
+    reset_collector();
+    node::ptr root(new node);
+    auto child = node::make_child(root);
+    auto grandchild = node::make_child(child);
+    child.reset();
+    grandchild.reset();
+    EXPECT_EQ(collector().collect(), 0u);
+    EXPECT_EQ(node::instance_count, 3);
+    EXPECT_EQ(root->children[0]->children.size(), 1u);
+    // only the subtree becomes garbage
+    root->children.clear();
+    EXPECT_EQ(collector().collect(), 2u);
+    EXPECT_EQ(node::instance_count, 1);
+    root.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(cycle_collector, self_cycle)
+{
+    reset_collector();
+    auto n = new node;
+    n->parent = node::ptr(n);
+    n->children.push_back(n->parent);
+    n->children.pop_back();
+    EXPECT_EQ(collector().collect_step(), 1u);
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(cycle_collector, released_while_buffered)
+{
+    reset_collector();
+    node::ptr p(new node);
+    auto q = p;
+    q.reset(); // buffers p
+    EXPECT_EQ(collector().get_stats().roots, 1u);
+    p.reset();
+    // kept for the collector, which owns the buffer entry
+    EXPECT_EQ(node::instance_count, 1);
+    EXPECT_EQ(collector().collect_step(), 0u);
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(cycle_collector, dead_roots_count_against_budget)
+{
+    reset_collector();
+    for (int i = 0; i < 25; i++) {
+        node::ptr p(new node);
+        auto q = p;
+        q.reset(); // buffers p, which then dies in the buffer
+    }
+    EXPECT_EQ(node::instance_count, 25);
+    collector().collect_step(10);
+    EXPECT_EQ(node::instance_count, 15);
+    EXPECT_EQ(collector().get_stats().roots, 15u);
+    collector().collect_step(10);
+    collector().collect_step(10);
+    EXPECT_EQ(node::instance_count, 0);
+    EXPECT_EQ(collector().get_stats().roots, 0u);
+    EXPECT_EQ(collector().get_stats().deferred, 0u);
+}
+
+TEST(cycle_collector, bounded_step)
+{
+    reset_collector();
+    {
+        node::ptr root(new node);
+        for (int i = 0; i < 100; i++)
+            node::make_child(root);
+    }
+    auto before = collector().get_stats();
+    // too big for the budget: deferred, nothing freed
+    while (collector().get_stats().roots)
+        EXPECT_EQ(collector().collect_step(10), 0u);
+    auto after = collector().get_stats();
+    EXPECT_GT(after.aborted, before.aborted);
+    EXPECT_GT(after.deferred, 0u);
+    EXPECT_EQ(node::instance_count, 101);
+    // steps don't look at deferred roots
+    EXPECT_EQ(collector().collect_step(), 0u);
+    EXPECT_EQ(collector().collect(), 101u);
+    EXPECT_EQ(node::instance_count, 0);
+    EXPECT_EQ(collector().get_stats().deferred, 0u);
+}
+
+TEST(cycle_collector, deferred_root_dies)
+{
+    reset_collector();
+    node::ptr root(new node);
+    for (int i = 0; i < 100; i++)
+        root->children.emplace_back(new node); // no cycles
+    node::ptr(root).reset();                   // buffers root
+    EXPECT_EQ(collector().collect_step(10), 0u);
+    EXPECT_EQ(collector().get_stats().deferred, 1u);
+    root.reset();
+    EXPECT_EQ(node::instance_count, 101);
+    // a step deletes it, no collect() needed
+    collector().collect_step(10);
+    EXPECT_EQ(node::instance_count, 0);
+    EXPECT_EQ(collector().get_stats().deferred, 0u);
+}
+
+TEST(cycle_collector, incremental_steps)
+{
+    reset_collector();
+    for (int i = 0; i < 50; i++) {
+        node::ptr root(new node);
+        node::make_child(root);
+        node::make_child(root);
+    }
+    std::size_t freed = 0;
+    while (collector().get_stats().roots) {
+        auto n = collector().collect_step(20);
+        EXPECT_LE(n, 20u);
+        freed += n;
+    }
+    EXPECT_EQ(freed, 150u);
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(cycle_collector, unreported_pointers_are_safe)
+{
+    reset_collector();
+    opaque::ptr a(new opaque), b(new opaque);
+    a->other = b;
+    b->other = a;
+    opaque *raw = a.get();
+    a.reset();
+    b.reset();
+    // looks externally referenced, so it is left alone
+    EXPECT_EQ(collector().collect(), 0u);
+    EXPECT_EQ(raw->refcount(), 1u);
+    // break the cycle by hand
+    auto other = std::move(raw->other);
+    other->other.reset();
+}
+
+TEST(cycle_collector, roots_from_many_threads)
+{
+    constexpr int THREAD_COUNT = 4;
+    constexpr int CYCLES = 1000;
+
+    reset_collector();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        // each thread owns its graphs, collection runs after the join
+        threads.push_back(std::thread([]() {
+            for (int j = 0; j < CYCLES; j++) {
+                node::ptr root(new node);
+                node::make_child(root);
+            }
+        }));
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(collector().collect(), 2u * THREAD_COUNT * CYCLES);
+}
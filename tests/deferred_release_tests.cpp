@@ -0,0 +1,107 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <deferred_release.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct shared : public refc_deferred<shared> {
+    static std::atomic<int> instance_count;
+    ptr child;
+    shared(ptr c = {})
+        : child(std::move(c))
+    {
+        instance_count++;
+    }
+    ~shared()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> shared::instance_count = 0;
+
+unsigned long pending(const shared *p)
+{
+    return detail::deferred_releases::local()->pending(
+        static_cast<const refc_deferred<shared> *>(p));
+}
+} // namespace
+
+TEST(deferred_release, coalesced)
+{
+    {
+        deferred_release_batch batch;
+        shared::ptr p(new shared);
+        auto raw = p.get();
+        {
+            std::vector<shared::ptr> copies(100, p);
+            EXPECT_EQ(raw->refcount(), 101);
+        }
+        EXPECT_EQ(pending(raw), 100);
+        EXPECT_EQ(raw->refcount(), 101);
+        flush_deferred_releases();
+        EXPECT_EQ(pending(raw), 0);
+        EXPECT_EQ(raw->refcount(), 1);
+        p.reset();
+        EXPECT_EQ(shared::instance_count, 1);
+    }
+    EXPECT_EQ(shared::instance_count, 0);
+}
+
+TEST(deferred_release, cascading_release)
+{
+    {
+        shared::ptr p(new shared(shared::ptr(new shared)));
+    }
+    EXPECT_EQ(shared::instance_count, 2);
+    // child is released by the parent's destructor during the flush
+    flush_deferred_releases();
+    EXPECT_EQ(shared::instance_count, 0);
+}
+
+TEST(deferred_release, flush_when_full)
+{
+    {
+        std::vector<shared::ptr> objects;
+        for (unsigned i = 0; i < detail::deferred_releases::capacity; i++)
+            objects.emplace_back(new shared);
+    }
+    EXPECT_LT(shared::instance_count, int(detail::deferred_releases::capacity));
+    flush_deferred_releases();
+    EXPECT_EQ(shared::instance_count, 0);
+}
+
+TEST(deferred_release, many_threads)
+{
+    constexpr int THREAD_COUNT = 4;
+    for (int round = 0; round < 100; round++) {
+        shared::ptr p(new shared);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            threads.emplace_back([p]() mutable {
+                for (int j = 0; j < 100; j++) {
+                    auto copy = p;
+                }
+                p.reset();
+                // thread exit flushes whatever is left
+            });
+        }
+        p.reset();
+        flush_deferred_releases();
+        for (auto &t : threads)
+            t.join();
+        EXPECT_EQ(shared::instance_count, 0);
+    }
+}
+
+TEST(deferred_release, cascade_at_thread_exit)
+{
+    std::thread([] {
+        // the parent's release is buffered, the child's is buffered again
+        // by the parent's destructor during the exit flush
+        shared::ptr p(new shared(shared::ptr(new shared(shared::ptr(
+            new shared)))));
+    }).join();
+    EXPECT_EQ(shared::instance_count, 0);
+}
@@ -0,0 +1,105 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <atomic_refc_ptr.h>
+#include <epoch.h>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct node : public refc_epoch<node> {
+    static std::atomic<int> instance_count;
+    int value;
+    ptr next;
+    node(int v, ptr n = {})
+        : value(v)
+        , next(std::move(n))
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        value = -1;
+        instance_count--;
+    }
+};
+std::atomic<int> node::instance_count = 0;
+} // namespace
+
+TEST(epoch, retire_waits_for_readers)
+{
+    auto &domain = epoch_domain::instance();
+    node::ptr p(new node(1));
+    const node *raw = p.get();
+    std::thread waiter;
+    {
+        epoch_guard g;
+        p.reset();
+        // another thread cannot make progress past our critical section
+        waiter = std::thread([&] { domain.synchronize(); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(node::instance_count, 1);
+        EXPECT_EQ(raw->value, 1);
+    }
+    waiter.join();
+    domain.synchronize();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(epoch, nested_guards)
+{
+    auto &domain = epoch_domain::instance();
+    {
+        epoch_guard g1;
+        {
+            epoch_guard g2;
+        }
+        auto e = domain.epoch();
+        std::thread([&] {
+            // can advance at most once past our announced epoch
+            for (int i = 0; i < 100; i++) {
+                node::ptr(new node(i));
+            }
+        }).join();
+        EXPECT_LE(domain.epoch(), e + 1);
+    }
+    domain.synchronize();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(epoch, raw_traversal)
+{
+    constexpr int READERS = 3;
+    constexpr int UPDATES = 5000;
+    auto &domain = epoch_domain::instance();
+    {
+        // list head replaced by writers, readers walk it without refcounting
+        atomic_refc_ptr<node> head(node::ptr(new node(0)));
+        std::atomic<bool> done{ false };
+        std::vector<std::thread> readers;
+        for (int i = 0; i < READERS; i++) {
+            readers.emplace_back([&] {
+                while (!done) {
+                    epoch_guard g;
+                    const node *n = head.load().get();
+                    int last = n->value + 1;
+                    for (; n; n = n->next.get()) {
+                        EXPECT_LT(n->value, last);
+                        last = n->value;
+                    }
+                }
+            });
+        }
+        for (int i = 1; i <= UPDATES; i++) {
+            auto cur = head.load();
+            // keep the list short: new head points at the current one only
+            node::ptr n(new node(i, node::ptr(new node(cur->value))));
+            head.store(std::move(n));
+        }
+        done = true;
+        for (auto &t : readers)
+            t.join();
+    }
+    domain.synchronize();
+    EXPECT_EQ(node::instance_count, 0);
+}
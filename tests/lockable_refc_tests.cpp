@@ -0,0 +1,105 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <gtest/gtest.h>
+#include <lockable_refc.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+struct counter : public refc_lockable<counter> {
+    static std::atomic<int> instance_count;
+    long value = 0;
+    counter()
+    {
+        instance_count++;
+    }
+    ~counter()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> counter::instance_count = 0;
+
+struct sentinel : public refc_lockable<sentinel> {
+    constexpr sentinel()
+        : refc_lockable(refc_immortal)
+    {}
+};
+} // namespace
+
+TEST(refc_lockable, no_extra_space)
+{
+    static_assert(sizeof(refc_lockable<counter>) == sizeof(refc<counter>));
+}
+
+TEST(refc_lockable, lock_and_count)
+{
+    {
+        counter::ptr p(new counter);
+        EXPECT_EQ(p->refcount(), 1);
+        EXPECT_TRUE(p->try_lock());
+        EXPECT_TRUE(p->is_locked());
+        EXPECT_FALSE(p->try_lock());
+        // counting works while locked and leaves the lock alone
+        auto q = p;
+        EXPECT_EQ(p->refcount(), 2);
+        q.reset();
+        EXPECT_EQ(p->refcount(), 1);
+        EXPECT_TRUE(p->is_locked());
+        p->unlock();
+        EXPECT_FALSE(p->is_locked());
+        {
+            std::lock_guard<counter> l(*p);
+            EXPECT_TRUE(p->is_locked());
+            EXPECT_EQ(p->shared_from_this()->refcount(), 2);
+        }
+        EXPECT_FALSE(p->is_locked());
+        EXPECT_EQ(p->refcount(), 1);
+    }
+    EXPECT_EQ(counter::instance_count, 0);
+}
+
+TEST(refc_lockable, immortal)
+{
+    static sentinel s;
+    sentinel::ptr p(&s);
+    s.lock();
+    auto q = p;
+    s.unlock();
+    q.reset();
+    p.reset();
+    EXPECT_FALSE(s.is_locked());
+}
+
+TEST(refc_lockable, contention)
+{
+    constexpr int ITERATIONS = 20000;
+    constexpr int THREAD_COUNT = 4;
+
+    counter::ptr p(new counter);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        threads.push_back(std::thread([p]() {
+            for (int j = 0; j < ITERATIONS; j++) {
+                if (j % 2) {
+                    std::lock_guard<counter> l(*p);
+                    p->value++;
+                } else {
+                    // reference counting races with the lock holders
+                    auto copy = p;
+                    while (!copy->try_lock()) {
+                    }
+                    copy->value++;
+                    copy->unlock();
+                }
+            }
+        }));
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(p->value, ITERATIONS * THREAD_COUNT);
+    EXPECT_EQ(p->refcount(), 1);
+    EXPECT_FALSE(p->is_locked());
+    p.reset();
+    EXPECT_EQ(counter::instance_count, 0);
+}
@@ -0,0 +1,245 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <gtest/gtest.h>
+#include <make_ptr.h>
+#include <ptr.h>
+#include <thread>
+
+namespace {
+// new_delete_resource that keeps count of what is outstanding
+class counting_resource : public std::pmr::memory_resource {
+public:
+    std::size_t allocations = 0;
+    std::size_t bytes = 0;
+
+private:
+    void *do_allocate(std::size_t n, std::size_t align) override
+    {
+        allocations++;
+        bytes += n;
+        return std::pmr::new_delete_resource()->allocate(n, align);
+    }
+    void do_deallocate(void *p, std::size_t n, std::size_t align) override
+    {
+        allocations--;
+        bytes -= n;
+        std::pmr::new_delete_resource()->deallocate(p, n, align);
+    }
+    bool do_is_equal(const memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+struct node : public refc<node>, public pmr_allocated {
+    static std::atomic<int> instance_count;
+    int value;
+    node(int v)
+        : value(v)
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> node::instance_count = 0;
+
+struct big_node : public node {
+    char payload[500];
+    big_node()
+        : node(0)
+    {}
+};
+
+struct weak_node : public refc_weak_base<weak_node>, public pmr_allocated {
+    using ptr = refc_ptr<weak_node>;
+};
+
+struct alignas(128) wide_node : public refc<wide_node>, public pmr_allocated {
+    int value = 3;
+};
+
+struct alignas(64) wide_weak_node : public refc_weak_base<wide_weak_node>,
+                                    public pmr_allocated {
+    using ptr = refc_ptr<wide_weak_node>;
+};
+
+bool aligned(const void *p, std::size_t align)
+{
+    return reinterpret_cast<std::uintptr_t>(p) % align == 0;
+}
+
+struct shared_node {
+    template <typename T> using ptr_templ = std::shared_ptr<T>;
+    int value;
+    shared_node(int v)
+        : value(v)
+    {}
+};
+
+struct throws : public refc<throws>, public pmr_allocated {
+    throws()
+    {
+        throw std::runtime_error("ctor");
+    }
+};
+} // namespace
+
+TEST(allocate_ptr, refc)
+{
+    counting_resource r;
+    {
+        auto p = allocate_ptr<node>(&r, 5);
+        static_assert(std::is_same_v<decltype(p), node::ptr>);
+        EXPECT_EQ(p->value, 5);
+        EXPECT_EQ(r.allocations, 1);
+        node::ptr d = allocate_ptr<big_node>(std::pmr::polymorphic_allocator<std::byte>(&r));
+        EXPECT_GT(r.bytes, sizeof(big_node));
+        EXPECT_EQ(node::instance_count, 2);
+    }
+    EXPECT_EQ(node::instance_count, 0);
+    EXPECT_EQ(r.allocations, 0);
+    EXPECT_EQ(r.bytes, 0);
+}
+
+TEST(allocate_ptr, default_resource)
+{
+    counting_resource r;
+    auto old = std::pmr::set_default_resource(&r);
+    {
+        auto p = make_ptr<node>(1);
+        EXPECT_EQ(r.allocations, 1);
+    }
+    std::pmr::set_default_resource(old);
+    EXPECT_EQ(r.allocations, 0);
+}
+
+TEST(allocate_ptr, weak_outlives_object)
+{
+    counting_resource r;
+    refc_weak_ptr<weak_node> w;
+    {
+        auto p = allocate_ptr<weak_node>(&r);
+        w = p;
+    }
+    EXPECT_FALSE(w.lock());
+    EXPECT_EQ(r.allocations, 1);
+    w = refc_weak_ptr<weak_node>();
+    EXPECT_EQ(r.allocations, 0);
+}
+
+TEST(allocate_ptr, shared_ptr)
+{
+    counting_resource r;
+    {
+        auto p = allocate_ptr<shared_node>(&r, 3);
+        static_assert(std::is_same_v<decltype(p), std::shared_ptr<shared_node>>);
+        EXPECT_EQ(p->value, 3);
+        EXPECT_EQ(r.allocations, 1);
+        auto q = allocate_ptr<shared_node>(std::allocator<shared_node>(), 4);
+        EXPECT_EQ(q->value, 4);
+    }
+    EXPECT_EQ(r.allocations, 0);
+}
+
+TEST(allocate_ptr, monotonic_resource)
+{
+    std::pmr::monotonic_buffer_resource arena;
+    auto p = allocate_ptr<node>(&arena, 1);
+    auto q = allocate_ptr<node>(&arena, 2);
+    EXPECT_EQ(p->value + q->value, 3);
+    p.reset();
+    q.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(allocate_ptr, constructor_throws)
+{
+    counting_resource r;
+    EXPECT_THROW(allocate_ptr<throws>(&r), std::runtime_error);
+    EXPECT_EQ(r.allocations, 0);
+}
+
+TEST(allocate_ptr, over_aligned)
+{
+    counting_resource r;
+    {
+        auto p = allocate_ptr<wide_node>(&r);
+        auto q = make_ptr<wide_node>();
+        EXPECT_TRUE(aligned(p.get(), 128));
+        EXPECT_TRUE(aligned(q.get(), 128));
+        EXPECT_EQ(p->value, 3);
+        EXPECT_EQ(r.allocations, 1);
+
+        refc_weak_ptr<wide_weak_node> w;
+        {
+            auto x = allocate_ptr<wide_weak_node>(&r);
+            EXPECT_TRUE(aligned(x.get(), 64));
+            w = x;
+        }
+        EXPECT_EQ(r.allocations, 2);
+    }
+    EXPECT_EQ(r.allocations, 0);
+    EXPECT_EQ(r.bytes, 0);
+}
+
+TEST(make_ptr_n, contiguous_block)
+{
+    {
+        auto nodes = make_ptr_n<node>(100, 7);
+        static_assert(std::is_same_v<decltype(nodes), std::vector<node::ptr>>);
+        ASSERT_EQ(nodes.size(), 100);
+        EXPECT_EQ(node::instance_count, 100);
+        auto stride = pmr_allocated::allocation_size(sizeof(node));
+        auto first = reinterpret_cast<char *>(nodes.front().get());
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            EXPECT_EQ(nodes[i]->value, 7);
+            EXPECT_EQ(reinterpret_cast<char *>(nodes[i].get()), first + i * stride);
+        }
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(make_ptr_n, independent_lifetimes)
+{
+    node::ptr survivor;
+    {
+        auto nodes = make_ptr_n<node>(10, 1);
+        survivor = nodes[5];
+        nodes[0].reset();
+        EXPECT_EQ(node::instance_count, 9);
+    }
+    // the block outlives all but one of its objects
+    EXPECT_EQ(node::instance_count, 1);
+    EXPECT_EQ(survivor->value, 1);
+    survivor.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(make_ptr_n, cross_thread_release)
+{
+    auto nodes = make_ptr_n<node>(1000, 2);
+    std::vector<node::ptr> half(nodes.begin(), nodes.begin() + 500);
+    nodes.erase(nodes.begin(), nodes.begin() + 500);
+    std::thread t([&] { half.clear(); });
+    nodes.clear();
+    t.join();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(make_ptr_n, constructor_throws)
+{
+    EXPECT_THROW(make_ptr_n<throws>(3), std::runtime_error);
+    EXPECT_TRUE(make_ptr_n<node>(0, 1).empty());
+}
+
+TEST(make_ptr_n, over_aligned)
+{
+    auto nodes = make_ptr_n<wide_node>(10);
+    for (auto &p : nodes) {
+        EXPECT_TRUE(aligned(p.get(), 128));
+        EXPECT_EQ(p->value, 3);
+    }
+}
@@ -0,0 +1,164 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <gtest/gtest.h>
+#include <make_ptr.h>
+#include <pool.h>
+#include <ptr.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct pooled : public refc<pooled>, public pool_allocated {
+    static int instance_count;
+    int value;
+    pooled(int v)
+        : value(v)
+    {
+        instance_count++;
+    }
+    ~pooled()
+    {
+        instance_count--;
+    }
+};
+int pooled::instance_count = 0;
+
+struct big_pooled : public pooled {
+    char payload[3000];
+    big_pooled()
+        : pooled(0)
+    {}
+};
+
+struct weak_pooled : public refc_weak_base<weak_pooled>,
+                     public pool_allocated {
+    int value = 7;
+};
+
+template <std::size_t Align>
+struct alignas(Align) aligned_pooled : public refc<aligned_pooled<Align>>,
+                                       public pool_allocated {
+    char payload[24];
+};
+
+// constructed before the thread's pool cache, so destroyed after it
+struct late_release {
+    pooled::ptr p;
+    ~late_release()
+    {
+        p.reset();
+        p = make_ptr<pooled>(1);
+        p.reset();
+    }
+};
+
+bool in_pool_slab(const void *p)
+{
+    // blocks never start a slab, the header does
+    return reinterpret_cast<std::uintptr_t>(p) % slab_pool::slab_size != 0;
+}
+} // namespace
+
+TEST(slab_pool, reuses_freed_blocks)
+{
+    auto p = slab_pool::allocate(40);
+    slab_pool::deallocate(p);
+    auto before = slab_pool::get_stats();
+    auto q = slab_pool::allocate(33);
+    auto after = slab_pool::get_stats();
+    // 33 and 40 share the 48 byte class, last in first out
+    EXPECT_EQ(p, q);
+    EXPECT_EQ(after.hits, before.hits + 1);
+    EXPECT_EQ(after.misses, before.misses);
+    slab_pool::deallocate(q);
+}
+
+TEST(slab_pool, large_blocks)
+{
+    auto before = slab_pool::get_stats();
+    auto p = slab_pool::allocate(100000);
+    auto during = slab_pool::get_stats();
+    EXPECT_EQ(during.misses, before.misses + 1);
+    EXPECT_GE(during.bytes_held, before.bytes_held + 100000);
+    slab_pool::deallocate(p);
+    EXPECT_EQ(slab_pool::get_stats().bytes_held, before.bytes_held);
+}
+
+TEST(slab_pool, make_ptr)
+{
+    void *addr;
+    {
+        auto p = make_ptr<pooled>(1);
+        addr = p.get();
+        EXPECT_TRUE(in_pool_slab(addr));
+        EXPECT_EQ(pooled::instance_count, 1);
+    }
+    EXPECT_EQ(pooled::instance_count, 0);
+    auto before = slab_pool::get_stats();
+    auto p = make_ptr<pooled>(2);
+    EXPECT_EQ(p.get(), addr);
+    EXPECT_EQ(slab_pool::get_stats().hits, before.hits + 1);
+    p.reset();
+
+    pooled::ptr big(new big_pooled);
+    EXPECT_EQ(pooled::instance_count, 1);
+    big.reset();
+    EXPECT_EQ(pooled::instance_count, 0);
+}
+
+TEST(slab_pool, weak_frees_to_pool)
+{
+    refc_ptr<weak_pooled> p(new weak_pooled);
+    refc_weak_ptr<weak_pooled> w;
+    w = p;
+    void *addr = p.get();
+    p.reset();
+    EXPECT_FALSE(w.lock());
+    // storage is held by the weak reference until here
+    w = refc_weak_ptr<weak_pooled>();
+    refc_ptr<weak_pooled> q(new weak_pooled);
+    EXPECT_EQ(q.get(), addr);
+}
+
+TEST(slab_pool, cross_thread_release)
+{
+    std::vector<pooled::ptr> objects;
+    for (int i = 0; i < 2000; i++)
+        objects.push_back(make_ptr<pooled>(i));
+    std::thread t([&] { objects.clear(); });
+    t.join();
+    EXPECT_EQ(pooled::instance_count, 0);
+    // the exiting thread handed its blocks back, so no new slab is needed
+    auto before = slab_pool::get_stats();
+    for (int i = 0; i < 2000; i++)
+        objects.push_back(make_ptr<pooled>(i));
+    EXPECT_EQ(slab_pool::get_stats().bytes_held, before.bytes_held);
+    objects.clear();
+}
+
+TEST(slab_pool, over_aligned)
+{
+    auto check = [](auto p, std::size_t align) {
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(p.get()) % align, 0u);
+        EXPECT_TRUE(in_pool_slab(p.get()));
+    };
+    for (int i = 0; i < 3; i++) {
+        check(refc_ptr<aligned_pooled<32>>(new aligned_pooled<32>), 32);
+        check(refc_ptr<aligned_pooled<64>>(new aligned_pooled<64>), 64);
+        check(refc_ptr<aligned_pooled<256>>(new aligned_pooled<256>), 256);
+    }
+    std::vector<refc_ptr<aligned_pooled<32>>> objects(100);
+    for (auto &p : objects) {
+        p = new aligned_pooled<32>;
+        EXPECT_EQ(reinterpret_cast<std::uintptr_t>(p.get()) % 32, 0u);
+    }
+}
+
+TEST(slab_pool, release_after_thread_cache)
+{
+    std::thread t([] {
+        static thread_local late_release holder;
+        holder.p = make_ptr<pooled>(0);
+    });
+    t.join();
+    EXPECT_EQ(pooled::instance_count, 0);
+}
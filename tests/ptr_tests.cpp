@@ -987,3 +987,424 @@ TYPED_TEST(refc_ptr_ste, self_reference)
     ptr->reset();
     EXPECT_EQ(base::instances(), 0);
 }
+
+namespace refc_test {
+struct local : public refc_local<local> {
+    static int instance_count;
+    local()
+    {
+        instance_count++;
+    }
+    ~local()
+    {
+        instance_count--;
+    }
+};
+int local::instance_count = 0;
+
+struct local_weak : public refc_local_weak_base<local_weak> {
+    static int instance_count;
+    local_weak()
+    {
+        instance_count++;
+    }
+    ~local_weak()
+    {
+        instance_count--;
+    }
+};
+int local_weak::instance_count = 0;
+} // namespace refc_test
+
+TEST(refc_local, basic)
+{
+    {
+        local::ptr p(new local);
+        EXPECT_EQ(local::instance_count, 1);
+        EXPECT_EQ(p->refcount(), 1);
+        {
+            auto p2 = p;
+            EXPECT_EQ(p->refcount(), 2);
+            local::ptr p3 = p2->shared_from_this();
+            EXPECT_EQ(p3, p);
+            EXPECT_EQ(p->refcount(), 3);
+        }
+        EXPECT_EQ(p->refcount(), 1);
+    }
+    EXPECT_EQ(local::instance_count, 0);
+}
+
+TEST(refc_local, weak_ptr_basic)
+{
+    refc_weak_ptr<local_weak> pw;
+    {
+        refc_ptr<local_weak> p(new local_weak);
+        pw = p;
+        EXPECT_EQ(pw.lock().get(), p.get());
+        EXPECT_EQ(p->refcount(), 1);
+    }
+    EXPECT_EQ(local_weak::instance_count, 0);
+    EXPECT_EQ(pw.lock().get(), nullptr);
+}
+
+TEST(refc_local, adopt_thread)
+{
+    local *raw = nullptr;
+    std::thread([&] { raw = new local; }).join();
+    raw->adopt_thread();
+    local::ptr p(raw);
+    EXPECT_EQ(p->refcount(), 1);
+}
+
+#if REFC_LOCAL_CHECK_THREAD
+TEST(refc_local_death, foreign_thread)
+{
+    local::ptr p(new local);
+    EXPECT_DEATH(std::thread([&] { local::ptr p2(p); }).join(), "foreign thread");
+}
+#endif
+
+namespace refc_test {
+struct packed : public refc_packed_weak_base<packed> {
+    static std::atomic<int> instance_count;
+    int value = 100500;
+    std::vector<int> values = { 1, 2, 3 };
+    packed()
+    {
+        instance_count++;
+    }
+    ~packed()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> packed::instance_count = 0;
+} // namespace refc_test
+
+TEST(refc_packed_weak_base, header_size)
+{
+    struct empty : public refc<empty> {};
+    struct empty_packed : public refc_packed_weak_base<empty_packed> {};
+    struct empty_weak : public refc_weak_base<empty_weak> {};
+    EXPECT_EQ(sizeof(empty_packed), sizeof(empty));
+    EXPECT_LT(sizeof(empty_packed), sizeof(empty_weak));
+}
+
+TEST(refc_packed_weak_base, weak_ptr_basic)
+{
+    refc_weak_ptr<packed> pw;
+    {
+        packed::ptr p(new packed);
+        EXPECT_EQ(p->refcount(), 1);
+        pw = p;
+        auto p2 = pw.lock();
+        EXPECT_EQ(p2, p);
+        EXPECT_EQ(p->refcount(), 2);
+        auto pw2 = pw;
+        EXPECT_EQ(pw2.lock(), p);
+    }
+    EXPECT_EQ(packed::instance_count, 0);
+    EXPECT_FALSE(pw.lock());
+}
+
+TEST(refc_packed_weak_base, try_ref_race)
+{
+    constexpr int ITERATIONS = 10000;
+    constexpr int THREAD_COUNT = 4;
+
+    std::vector<std::thread> threads;
+    std::vector<packed::ptr> ptrs(ITERATIONS);
+    std::vector<refc_weak_ptr<packed>> weak_ptrs(ITERATIONS);
+    for (int i = 0; i < ITERATIONS; i++) {
+        ptrs[i] = packed::ptr(new packed);
+        weak_ptrs[i] = ptrs[i];
+    }
+    std::atomic<bool> done(false);
+    for (int i = 1; i < THREAD_COUNT; i++) {
+        threads.push_back(std::thread([&]() {
+            for (int j = 0; j < ITERATIONS && !done; j++) {
+                auto ptr = weak_ptrs[j].lock();
+                if (ptr) {
+                    EXPECT_EQ(ptr->value, 100500);
+                    EXPECT_EQ(ptr->values[2], 3);
+                }
+            }
+        }));
+    }
+    for (auto &p : ptrs) {
+        p.reset();
+        std::this_thread::sleep_for(std::chrono::microseconds(1));
+    }
+    done = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(packed::instance_count, 0);
+}
+
+namespace refc_test {
+struct sentinel : public refc<sentinel> {
+    using policy_type = immortal_refc_policy;
+    using ptr = refc_ptr<sentinel, policy_type>;
+    constexpr sentinel()
+        : refc(refc_immortal)
+    {}
+    int value = 42;
+};
+
+// immortal, but counted through the plain policy
+struct plain_sentinel : public refc<plain_sentinel> {
+    constexpr plain_sentinel()
+        : refc(refc_immortal)
+    {}
+    int value = 42;
+};
+
+struct weak_sentinel : public refc_weak_base<weak_sentinel> {
+    using policy_type = immortal_strong_refc_policy;
+    using weak_policy_type = immortal_weak_refc_policy;
+    using ptr = refc_ptr<weak_sentinel, policy_type>;
+    constexpr weak_sentinel()
+        : refc_weak_base(refc_immortal)
+    {}
+    int value = 42;
+};
+
+// immortal, but counted through the plain policies
+struct plain_weak_sentinel : public refc_weak_base<plain_weak_sentinel> {
+    constexpr plain_weak_sentinel()
+        : refc_weak_base(refc_immortal)
+    {}
+    int value = 42;
+};
+
+// constant initialized, no dynamic initialization
+sentinel static_sentinel;
+plain_sentinel static_plain_sentinel;
+weak_sentinel static_weak_sentinel;
+plain_weak_sentinel static_plain_weak_sentinel;
+} // namespace refc_test
+
+TEST(refc_immortal, static_object)
+{
+    auto before = static_sentinel.refcount();
+    {
+        sentinel::ptr p(&static_sentinel);
+        auto p2 = p;
+        EXPECT_EQ(p2->value, 42);
+        EXPECT_EQ(p->refcount(), before);
+    }
+    // releasing the last pointer must not delete static storage
+    EXPECT_EQ(static_sentinel.refcount(), before);
+}
+
+TEST(refc_immortal, plain_policy)
+{
+    auto before = static_plain_sentinel.refcount();
+    {
+        plain_sentinel::ptr p(&static_plain_sentinel);
+        auto p2 = p;
+        EXPECT_EQ(p->refcount(), before + 2);
+    }
+    // counted, but nowhere near zero
+    EXPECT_EQ(static_plain_sentinel.refcount(), before);
+    EXPECT_EQ(static_plain_sentinel.value, 42);
+}
+
+TEST(refc_immortal, weak_lock_always_succeeds)
+{
+    refc_weak_ptr<weak_sentinel> w;
+    {
+        refc_ptr<weak_sentinel> p(&static_weak_sentinel);
+        w = p;
+    }
+    auto p = w.lock();
+    ASSERT_TRUE(p);
+    EXPECT_EQ(p->value, 42);
+    w = refc_weak_ptr<weak_sentinel>();
+    EXPECT_EQ(w.lock().get(), nullptr);
+    EXPECT_EQ(static_weak_sentinel.value, 42);
+}
+
+TEST(refc_immortal, plain_weak_policies)
+{
+    auto before = static_plain_weak_sentinel.refcount();
+    refc_weak_ptr<plain_weak_sentinel> w;
+    {
+        refc_ptr<plain_weak_sentinel> p(&static_plain_weak_sentinel);
+        w = p;
+        EXPECT_EQ(p->refcount(), before + 1);
+    }
+    auto p = w.lock();
+    ASSERT_TRUE(p);
+    EXPECT_EQ(p->value, 42);
+    p.reset();
+    w = refc_weak_ptr<plain_weak_sentinel>();
+    EXPECT_EQ(static_plain_weak_sentinel.refcount(), before);
+    EXPECT_EQ(static_plain_weak_sentinel.value, 42);
+}
+
+TEST(refc_immortal, shared_across_threads)
+{
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([] {
+            for (int j = 0; j < 10000; j++) {
+                sentinel::ptr p(&static_sentinel);
+                EXPECT_EQ(p->value, 42);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    EXPECT_EQ(static_sentinel.value, 42);
+}
+
+namespace refc_test {
+struct nv_base {
+    static int instance_count;
+    int value = 1;
+    nv_base()
+    {
+        instance_count++;
+    }
+    ~nv_base()
+    {
+        instance_count--;
+    }
+};
+int nv_base::instance_count = 0;
+
+struct nv_leaf final : public nv_base, public refc_nonvirtual<nv_leaf> {
+    static int instance_count;
+    std::vector<int> values = { 1, 2, 3 };
+    nv_leaf()
+    {
+        instance_count++;
+    }
+    ~nv_leaf()
+    {
+        instance_count--;
+    }
+};
+int nv_leaf::instance_count = 0;
+
+struct nv_small final : public refc_nonvirtual<nv_small> {
+    int value = 0;
+};
+struct v_small final : public refc<v_small> {
+    int value = 0;
+};
+
+struct nv_polymorphic : public refc_nonvirtual<nv_polymorphic> {
+    static int instance_count;
+    virtual ~nv_polymorphic() = default;
+};
+struct nv_derived : public nv_polymorphic {
+    nv_derived()
+    {
+        nv_polymorphic::instance_count++;
+    }
+    ~nv_derived()
+    {
+        nv_polymorphic::instance_count--;
+    }
+};
+int nv_polymorphic::instance_count = 0;
+} // namespace refc_test
+
+TEST(refc_nonvirtual, no_vptr)
+{
+    EXPECT_FALSE(std::is_polymorphic_v<nv_small>);
+    EXPECT_LT(sizeof(nv_small), sizeof(v_small));
+    nv_small::ptr p(new nv_small);
+    auto p2 = p;
+    EXPECT_EQ(p->refcount(), 2);
+}
+
+TEST(refc_nonvirtual, deletes_as_t)
+{
+    {
+        refc_ptr<nv_leaf> leaf(new nv_leaf);
+        EXPECT_EQ(nv_leaf::instance_count, 1);
+        EXPECT_EQ(nv_base::instance_count, 1);
+        EXPECT_EQ(leaf->values[2], 3);
+        auto other = leaf->shared_from_this();
+        EXPECT_EQ(other, leaf);
+        EXPECT_EQ(leaf->refcount(), 2);
+    }
+    EXPECT_EQ(nv_leaf::instance_count, 0);
+    EXPECT_EQ(nv_base::instance_count, 0);
+}
+
+TEST(refc_nonvirtual, virtual_destructor_in_t)
+{
+    {
+        refc_ptr<nv_polymorphic> p(new nv_derived);
+        EXPECT_EQ(nv_polymorphic::instance_count, 1);
+        auto d = std::static_pointer_cast<nv_derived>(p);
+        EXPECT_EQ(p->refcount(), 2);
+        refc_ptr<nv_polymorphic> up = d;
+        EXPECT_EQ(up, p);
+        EXPECT_EQ(p->shared_from_this<nv_derived>(), d);
+        EXPECT_EQ(p->refcount(), 3);
+    }
+    EXPECT_EQ(nv_polymorphic::instance_count, 0);
+}
+
+namespace refc_test {
+struct borrowed : public refc<borrowed> {
+    int value = 5;
+};
+struct borrowed_derived : public borrowed {};
+
+int read(refc_ref<borrowed> r)
+{
+    return r ? r->value : -1;
+}
+
+borrowed::ptr keep(refc_ref<borrowed> r)
+{
+    return r.retain();
+}
+} // namespace refc_test
+
+TEST(refc_ref, borrows_without_counting)
+{
+    borrowed::ptr p(new borrowed);
+    refc_ptr<borrowed_derived> d(new borrowed_derived);
+    EXPECT_EQ(read(p), 5);
+    EXPECT_EQ(read(*p), 5);
+    EXPECT_EQ(read(d), 5);
+    EXPECT_EQ(read(nullptr), -1);
+    EXPECT_EQ(read(borrowed::ptr()), -1);
+    EXPECT_EQ(p->refcount(), 1);
+    refc_ref<borrowed> r = p;
+    EXPECT_EQ(r.get(), p.get());
+    EXPECT_EQ(&*r, p.get());
+    EXPECT_EQ(p->refcount(), 1);
+}
+
+TEST(refc_ref, retain)
+{
+    borrowed::ptr kept;
+    {
+        borrowed::ptr p(new borrowed);
+        kept = keep(p);
+        EXPECT_EQ(p->refcount(), 2);
+    }
+    EXPECT_EQ(kept->refcount(), 1);
+    EXPECT_FALSE(refc_ref<borrowed>().retain());
+}
+
+#if REFC_REF_CHECK
+TEST(refc_ref_death, unreferenced_object)
+{
+    EXPECT_DEATH(
+        {
+            borrowed b;
+            read(b);
+        },
+        "not referenced");
+}
+#endif
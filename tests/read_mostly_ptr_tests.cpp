@@ -0,0 +1,79 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <gtest/gtest.h>
+#include <read_mostly_ptr.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct table : public refc<table> {
+    static std::atomic<int> instance_count;
+    int version;
+    table(int v)
+        : version(v)
+    {
+        instance_count++;
+    }
+    ~table()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> table::instance_count = 0;
+} // namespace
+
+TEST(read_mostly_ptr, cached_read)
+{
+    {
+        read_mostly_ptr<table> h(table::ptr(new table(1)));
+        read_mostly_ptr<table>::reader r(h);
+        auto first = r.get().get();
+        EXPECT_EQ(first->version, 1);
+        // holder + reader cache
+        EXPECT_EQ(first->refcount(), 2);
+        for (int i = 0; i < 10; i++)
+            EXPECT_EQ(r.get().get(), first);
+        EXPECT_EQ(first->refcount(), 2);
+
+        h.store(table::ptr(new table(2)));
+        // old snapshot pinned by the reader until it refreshes
+        EXPECT_EQ(table::instance_count, 2);
+        EXPECT_EQ((*r)->version, 2);
+        EXPECT_EQ(table::instance_count, 1);
+
+        auto owned = r.get();
+        r.reset();
+        EXPECT_EQ(owned->refcount(), 2);
+        EXPECT_EQ(h.load(), owned);
+    }
+    EXPECT_EQ(table::instance_count, 0);
+}
+
+TEST(read_mostly_ptr, concurrent_updates)
+{
+    constexpr int READERS = 4;
+    constexpr int UPDATES = 2000;
+    {
+        read_mostly_ptr<table> h(table::ptr(new table(0)));
+        std::atomic<bool> done{ false };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < READERS; i++) {
+            threads.emplace_back([&] {
+                read_mostly_ptr<table>::reader r(h);
+                int last = 0;
+                while (!done) {
+                    auto &p = r.get();
+                    EXPECT_GE(p->version, last);
+                    last = p->version;
+                }
+                EXPECT_EQ(r.get()->version, UPDATES);
+            });
+        }
+        for (int i = 1; i <= UPDATES; i++)
+            h.store(table::ptr(new table(i)));
+        done = true;
+        for (auto &t : threads)
+            t.join();
+    }
+    EXPECT_EQ(table::instance_count, 0);
+}
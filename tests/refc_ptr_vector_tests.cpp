@@ -0,0 +1,139 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <gtest/gtest.h>
+#include <refc_ptr_vector.h>
+#include <vector>
+
+namespace {
+// refc with a policy that counts the calls it gets
+struct counted : public refc<counted> {
+    static int instance_count;
+    struct policy {
+        static inline int calls = 0;
+        static auto add_ref(const counted *p, unsigned long n = 1) noexcept
+        {
+            calls++;
+            return refc_policy::add_ref(p, n);
+        }
+        static void release(const counted *p, unsigned long n = 1) noexcept
+        {
+            calls++;
+            refc_policy::release(p, n);
+        }
+    };
+    using policy_type = policy;
+    using ptr = refc_ptr<counted, policy>;
+    counted()
+    {
+        instance_count++;
+    }
+    ~counted()
+    {
+        instance_count--;
+    }
+};
+int counted::instance_count = 0;
+
+// same without the counted form
+struct single : public refc<single> {
+    struct policy {
+        static auto add_ref(const single *p) noexcept
+        {
+            return refc_policy::add_ref(p);
+        }
+        static void release(const single *p) noexcept
+        {
+            refc_policy::release(p);
+        }
+    };
+    using policy_type = policy;
+    using ptr = refc_ptr<single, policy>;
+};
+
+struct weak : public refc_weak_base<weak> {};
+struct packed : public refc_packed_weak_base<packed> {};
+struct local : public refc_local<local> {};
+} // namespace
+
+TEST(refc_ptr_vector, one_atomic_per_object)
+{
+    counted::ptr a(new counted), b(new counted);
+    std::vector<counted::ptr> src;
+    for (int i = 0; i < 1000; i++)
+        src.push_back(i % 3 ? a : b);
+    counted::policy::calls = 0;
+    refc_ptr_vector<counted> v(src.begin(), src.end());
+    EXPECT_EQ(counted::policy::calls, 2);
+    EXPECT_EQ(v.size(), 1000);
+    EXPECT_EQ(a->refcount(), 1 + 2 * 666);
+
+    counted::policy::calls = 0;
+    auto copy = v;
+    EXPECT_EQ(counted::policy::calls, 2);
+    copy.append(v);
+    EXPECT_EQ(counted::policy::calls, 4);
+    EXPECT_EQ(copy.size(), 2000);
+    EXPECT_EQ(copy[1], a.get());
+    EXPECT_EQ(copy[3], b.get());
+
+    counted::policy::calls = 0;
+    copy.clear();
+    v.clear();
+    EXPECT_EQ(counted::policy::calls, 4);
+    EXPECT_EQ(a->refcount(), 1 + 666);
+}
+
+TEST(refc_ptr_vector, ownership)
+{
+    {
+        refc_ptr_vector<counted> v;
+        v.push_back(counted::ptr(new counted));
+        v.push_back(counted::ptr(new counted));
+        v.push_back(nullptr);
+        EXPECT_EQ(counted::instance_count, 2);
+        auto first = v.at(0);
+        EXPECT_EQ(first->refcount(), 2);
+        auto last = v.pop_back();
+        EXPECT_FALSE(last);
+        refc_ptr_vector<counted> moved(std::move(v));
+        EXPECT_TRUE(v.empty());
+        EXPECT_EQ(moved.size(), 2);
+        EXPECT_EQ(std::count(moved.begin(), moved.end(), first.get()), 1);
+    }
+    EXPECT_EQ(counted::instance_count, 0);
+}
+
+TEST(refc_ptr_vector, policy_without_counted_form)
+{
+    single::ptr a(new single);
+    std::vector<single::ptr> src(10, a);
+    refc_ptr_vector<single> v(src.begin(), src.end());
+    EXPECT_EQ(a->refcount(), 21);
+    v.clear();
+    EXPECT_EQ(a->refcount(), 11);
+}
+
+TEST(counted_policies, add_and_release_n)
+{
+    refc_ptr<weak> w(new weak);
+    refc_weak_ptr<weak> ww;
+    ww = w;
+    weak::policy_type::add_ref(w.get(), 3);
+    EXPECT_EQ(w->refcount(), 4);
+    weak::policy_type::release(w.get(), 3);
+    weak::weak_policy_type::add_ref(w.get(), 2);
+    weak::weak_policy_type::release(w.get(), 2);
+    w.reset();
+    EXPECT_FALSE(ww.lock());
+
+    packed::ptr p(new packed);
+    packed::policy_type::add_ref(p.get(), 5);
+    EXPECT_EQ(p->refcount(), 6);
+    packed::policy_type::release(p.get(), 5);
+    EXPECT_EQ(p->refcount(), 1);
+
+    local::ptr l(new local);
+    local::policy_type::add_ref(l.get(), 2);
+    EXPECT_EQ(l->refcount(), 3);
+    local::policy_type::release(l.get(), 2);
+    EXPECT_EQ(l->refcount(), 1);
+}
@@ -0,0 +1,77 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <gtest/gtest.h>
+#include <sharded_refc.h>
+#include <thread>
+#include <vector>
+
+namespace {
+struct hot : public refc_sharded<hot, 4> {
+    static std::atomic<int> instance_count;
+    int value = 100500;
+    hot()
+    {
+        instance_count++;
+    }
+    ~hot()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> hot::instance_count = 0;
+} // namespace
+
+TEST(refc_sharded, live_until_killed)
+{
+    hot *raw = new hot;
+    {
+        hot::ptr p(raw);
+        auto p2 = p;
+        EXPECT_EQ(p->refcount(), 2);
+    }
+    EXPECT_EQ(hot::instance_count, 1);
+    EXPECT_EQ(raw->refcount(), 0);
+    raw->kill();
+    EXPECT_EQ(hot::instance_count, 0);
+}
+
+TEST(refc_sharded, last_release_after_kill)
+{
+    hot::ptr p(new hot);
+    auto p2 = p;
+    p->kill();
+    EXPECT_TRUE(p->is_killed());
+    EXPECT_EQ(p->refcount(), 2);
+    p.reset();
+    EXPECT_EQ(hot::instance_count, 1);
+    p2.reset();
+    EXPECT_EQ(hot::instance_count, 0);
+}
+
+TEST(refc_sharded, kill_under_contention)
+{
+    constexpr int THREAD_COUNT = 8;
+    for (int round = 0; round < 20; round++) {
+        hot::ptr p(new hot);
+        std::atomic<int> started{ 0 };
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            // each worker holds its own copy and hands copies across shards
+            threads.emplace_back([&started, mine = p]() mutable {
+                started++;
+                for (int j = 0; j < 2000; j++) {
+                    auto copy = mine;
+                    EXPECT_EQ(copy->value, 100500);
+                }
+                mine.reset();
+            });
+        }
+        while (started < THREAD_COUNT / 2)
+            std::this_thread::yield();
+        p->kill();
+        p.reset();
+        for (auto &t : threads)
+            t.join();
+        EXPECT_EQ(hot::instance_count, 0);
+    }
+}
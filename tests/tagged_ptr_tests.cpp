@@ -0,0 +1,115 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <gtest/gtest.h>
+#include <tagged_ptr.h>
+
+enum class edge_flags : unsigned {
+    none = 0,
+    dirty = 1,
+    pinned = 2,
+    shared = 4,
+    all = 7
+};
+ENABLE_BITMAP_OPERATORS(edge_flags)
+
+enum class one_flag : unsigned char { marked = 1 };
+ENABLE_BITMAP_OPERATORS(one_flag)
+
+namespace {
+struct node : public refc<node> {
+    static int instance_count;
+    int value = 7;
+    node()
+    {
+        instance_count++;
+    }
+    ~node()
+    {
+        instance_count--;
+    }
+};
+int node::instance_count = 0;
+
+struct weak_node : public refc_weak_base<weak_node> {};
+
+using edge = tagged_refc_ptr<node, edge_flags>;
+} // namespace
+
+TEST(tagged_refc_ptr, flags)
+{
+    static_assert(sizeof(edge) == sizeof(void *));
+    edge e(node::ptr(new node), edge_flags::dirty);
+    EXPECT_EQ(e->value, 7);
+    EXPECT_TRUE(e.test(edge_flags::dirty));
+    EXPECT_FALSE(e.test(edge_flags::pinned));
+    e.set(edge_flags::pinned | edge_flags::shared);
+    EXPECT_EQ(e.flags(), edge_flags::all);
+    e.clear(edge_flags::dirty);
+    EXPECT_EQ(e.flags(), edge_flags::pinned | edge_flags::shared);
+    EXPECT_EQ((*e).value, 7);
+    e.set_flags(edge_flags::none);
+    EXPECT_FALSE(e.test(edge_flags::all));
+    EXPECT_EQ(e->refcount(), 1);
+}
+
+TEST(tagged_refc_ptr, ownership)
+{
+    {
+        node::ptr p(new node);
+        edge a(p.get(), edge_flags::shared);
+        EXPECT_EQ(p->refcount(), 2);
+        auto b = a;
+        EXPECT_EQ(p->refcount(), 3);
+        EXPECT_EQ(a, b);
+        EXPECT_EQ(b.flags(), edge_flags::shared);
+        b.set(edge_flags::dirty);
+        EXPECT_NE(a, b);
+        edge c(std::move(b));
+        EXPECT_FALSE(b);
+        EXPECT_EQ(c.flags(), edge_flags::shared | edge_flags::dirty);
+        EXPECT_EQ(p->refcount(), 3);
+        node::ptr back = c;
+        EXPECT_EQ(back, p);
+        EXPECT_EQ(p->refcount(), 4);
+        c.reset();
+        EXPECT_EQ(c.flags(), edge_flags::none);
+        a.reset();
+        EXPECT_EQ(p->refcount(), 2);
+        // flags on a null pointer
+        edge n(nullptr);
+        n.set(edge_flags::pinned);
+        EXPECT_FALSE(n);
+        EXPECT_TRUE(n.test(edge_flags::pinned));
+    }
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(tagged_refc_ptr, detach_and_reset)
+{
+    edge e(node::ptr(new node), edge_flags::pinned);
+    auto raw = e.detach();
+    EXPECT_FALSE(e);
+    EXPECT_EQ(e.flags(), edge_flags::none);
+    e.reset(raw, edge_flags::dirty, false);
+    EXPECT_EQ(e->refcount(), 1);
+    EXPECT_TRUE(e.test(edge_flags::dirty));
+    e.reset();
+    EXPECT_EQ(node::instance_count, 0);
+}
+
+TEST(tagged_refc_ptr, explicit_mask_and_weak)
+{
+    // enum without `all`, mask given explicitly
+    refc_ptr<weak_node> p(new weak_node);
+    refc_weak_ptr<weak_node> w;
+    w = p;
+    {
+        using marked_ptr =
+            tagged_refc_ptr<weak_node, one_flag, one_flag::marked>;
+        marked_ptr t(p, one_flag::marked);
+        EXPECT_TRUE(t.test(one_flag::marked));
+        EXPECT_EQ(t.ptr(), p);
+        p.reset();
+        EXPECT_TRUE(w.lock());
+    }
+    EXPECT_FALSE(w.lock());
+}
@@ -0,0 +1,144 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <atomic>
+#include <gtest/gtest.h>
+#include <teardown.h>
+#include <vector>
+
+namespace {
+struct list_node : public refc_teardown<list_node> {
+    static std::atomic<int> instance_count;
+    ptr next;
+    list_node()
+    {
+        instance_count++;
+    }
+    ~list_node()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> list_node::instance_count = 0;
+
+struct tree_node : public refc_teardown<tree_node> {
+    static std::atomic<int> instance_count;
+    std::vector<ptr> children;
+    list_node::ptr chain;
+    tree_node()
+    {
+        instance_count++;
+    }
+    ~tree_node()
+    {
+        instance_count--;
+    }
+};
+std::atomic<int> tree_node::instance_count = 0;
+
+tree_node::ptr make_tree(int depth, int width)
+{
+    tree_node::ptr n(new tree_node);
+    if (depth > 0) {
+        for (int i = 0; i < width; i++)
+            n->children.push_back(make_tree(depth - 1, width));
+    }
+    return n;
+}
+
+class self_ref : public refc_teardown<self_ref> {
+public:
+    static int instance_count;
+    self_ref()
+        : self_(this)
+    {
+        instance_count++;
+    }
+    ~self_ref()
+    {
+        instance_count--;
+    }
+    void reset()
+    {
+        self_.reset();
+    }
+
+private:
+    ptr self_;
+};
+int self_ref::instance_count = 0;
+
+// releases a whole tree in parallel from its destructor
+struct owner : public refc_teardown<owner> {
+    tree_node::ptr tree;
+    ~owner()
+    {
+        parallel_teardown(std::move(tree), 2);
+    }
+};
+} // namespace
+
+TEST(refc_teardown, transitive)
+{
+    list_node::ptr p(new list_node);
+    p->next = list_node::ptr(new list_node);
+    EXPECT_TRUE(!p->next->next);
+    p = p->next;
+    EXPECT_TRUE(!p->next);
+    p.reset();
+    EXPECT_EQ(list_node::instance_count, 0);
+}
+
+TEST(refc_teardown, self_reference)
+{
+    auto p = new self_ref;
+    EXPECT_EQ(self_ref::instance_count, 1);
+    p->reset();
+    EXPECT_EQ(self_ref::instance_count, 0);
+}
+
+TEST(refc_teardown, long_list)
+{
+    // deep enough to overflow the stack if destruction recursed
+    constexpr int COUNT = 1000000;
+    list_node::ptr head;
+    for (int i = 0; i < COUNT; i++) {
+        list_node::ptr n(new list_node);
+        n->next = std::move(head);
+        head = std::move(n);
+    }
+    EXPECT_EQ(list_node::instance_count, COUNT);
+    head.reset();
+    EXPECT_EQ(list_node::instance_count, 0);
+}
+
+TEST(refc_teardown, parallel_tree)
+{
+    auto root = make_tree(8, 4);
+    EXPECT_EQ(tree_node::instance_count, 87381); // 4^0 + ... + 4^8
+    // a chain hanging off a leaf
+    auto leaf = root.get();
+    while (!leaf->children.empty())
+        leaf = leaf->children.back().get();
+    for (int i = 0; i < 100000; i++) {
+        list_node::ptr n(new list_node);
+        n->next = std::move(leaf->chain);
+        leaf->chain = std::move(n);
+    }
+    parallel_teardown(std::move(root), 4);
+    EXPECT_FALSE(root);
+    EXPECT_EQ(tree_node::instance_count, 0);
+    EXPECT_EQ(list_node::instance_count, 0);
+}
+
+TEST(refc_teardown, parallel_shared_and_nested)
+{
+    auto root = make_tree(3, 3);
+    auto keep = root;
+    // not the last reference, nothing to tear down
+    parallel_teardown(std::move(root), 4);
+    EXPECT_EQ(keep->refcount(), 1);
+
+    owner::ptr o(new owner);
+    o->tree = std::move(keep);
+    o.reset();
+    EXPECT_EQ(tree_node::instance_count, 0);
+}
@@ -0,0 +1,106 @@
+/// Copyright (c) 2018 Vassily Checkin. See included license file.
+#include <gtest/gtest.h>
+#include <numeric>
+#include <string>
+#include <trailing_array.h>
+
+namespace {
+struct tokens : public refc_trailing<tokens, int> {
+    int first;
+    tokens(trailing_count n, int f)
+        : refc_trailing(n)
+        , first(f)
+    {
+        std::iota(begin(), end(), f);
+    }
+};
+
+struct names : public refc_trailing<names, std::string> {
+    static int instance_count;
+    names(trailing_count n)
+        : refc_trailing(n)
+    {
+        instance_count++;
+    }
+    ~names()
+    {
+        instance_count--;
+    }
+};
+int names::instance_count = 0;
+
+struct alignas(64) wide {
+    static int instance_count;
+    static int fail_at;
+    char bytes[64];
+    wide()
+    {
+        if (instance_count == fail_at)
+            throw std::runtime_error("element");
+        instance_count++;
+    }
+    ~wide()
+    {
+        instance_count--;
+    }
+};
+int wide::instance_count = 0;
+int wide::fail_at = -1;
+
+struct wides : public refc_trailing<wides, wide> {
+    wides(trailing_count n)
+        : refc_trailing(n)
+    {}
+};
+} // namespace
+
+TEST(refc_trailing, single_allocation)
+{
+    auto t = make_trailing_ptr<tokens>(10, 5);
+    static_assert(std::is_same_v<decltype(t), tokens::ptr>);
+    ASSERT_EQ(t->size(), 10);
+    EXPECT_EQ(t->first, 5);
+    EXPECT_EQ((*t)[0], 5);
+    EXPECT_EQ((*t)[9], 14);
+    auto header = reinterpret_cast<char *>(t.get());
+    auto elements = reinterpret_cast<char *>(t->data());
+    EXPECT_GE(elements, header + sizeof(tokens));
+    EXPECT_LT(elements, header + sizeof(tokens) + alignof(int));
+    EXPECT_EQ(tokens::allocation_size(10), elements - header + 10 * sizeof(int));
+}
+
+TEST(refc_trailing, empty)
+{
+    auto t = make_trailing_ptr<tokens>(0, 1);
+    EXPECT_EQ(t->size(), 0);
+    EXPECT_EQ(t->begin(), t->end());
+}
+
+TEST(refc_trailing, destroys_elements)
+{
+    {
+        auto n = make_trailing_ptr<names>(3);
+        (*n)[2] = std::string(100, 'x');
+        names::ptr copy = n;
+        EXPECT_EQ(names::instance_count, 1);
+        EXPECT_EQ(copy->refcount(), 2);
+    }
+    EXPECT_EQ(names::instance_count, 0);
+}
+
+TEST(refc_trailing, over_aligned_elements)
+{
+    auto w = make_trailing_ptr<wides>(4);
+    EXPECT_EQ(wide::instance_count, 4);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(w->data()) % 64, 0);
+    w.reset();
+    EXPECT_EQ(wide::instance_count, 0);
+}
+
+TEST(refc_trailing, element_constructor_throws)
+{
+    wide::fail_at = 2;
+    EXPECT_THROW(make_trailing_ptr<wides>(4), std::runtime_error);
+    wide::fail_at = -1;
+    EXPECT_EQ(wide::instance_count, 0);
+}